@@ -0,0 +1,236 @@
+#include "alloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_SIZE 65536         // bytes per pool slab
+#define ARENA_BLOCK 65536       // bytes per arena block
+#define ALIGN sizeof(void *)    // alignment of every object and string
+
+
+/*
+ * Round n up to a multiple of ALIGN.
+ */
+static size_t align_up(size_t n) {
+    return (n + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+
+/*
+ * Initialize pool to hand out objects of obj_size bytes.
+ */
+void pool_init(Pool *pool, size_t obj_size) {
+    if (obj_size < sizeof(void *)) {    // room for the free list link
+        obj_size = sizeof(void *);
+    }
+    pool->obj_size = align_up(obj_size);
+    pool->slab_objs = SLAB_SIZE / pool->obj_size;
+    if (pool->slab_objs == 0) {
+        pool->slab_objs = 1;
+    }
+    pool->slab = NULL;
+    pool->slab_used = 0;
+    pool->free_list = NULL;
+    pool->reserved = 0;
+    pool->live = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+
+/*
+ * Return a new uninitialized object from pool. Exit if memory runs out.
+ */
+void *pool_alloc(Pool *pool) {
+    void *obj;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_list != NULL) {      // reuse a freed object first
+        obj = pool->free_list;
+        pool->free_list = *(void **)obj;
+    } else {
+        if (pool->slab == NULL || pool->slab_used == pool->slab_objs) {
+            pool->slab = malloc(pool->slab_objs * pool->obj_size);
+            if (pool->slab == NULL) {
+                perror("malloc");
+                exit(1);
+            }
+            pool->slab_used = 0;
+            pool->reserved += pool->slab_objs * pool->obj_size;
+        }
+        obj = pool->slab + pool->slab_used * pool->obj_size;
+        pool->slab_used++;
+    }
+    pool->live++;
+    pthread_mutex_unlock(&pool->lock);
+    return obj;
+}
+
+
+/*
+ * Return obj, which came from pool_alloc on the same pool, to pool.
+ */
+void pool_free(Pool *pool, void *obj) {
+    pthread_mutex_lock(&pool->lock);
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->live--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Add the memory usage of pool to stats.
+ */
+void pool_stats(Pool *pool, MemStats *stats) {
+    pthread_mutex_lock(&pool->lock);
+    stats->reserved += pool->reserved;
+    stats->used += pool->live * pool->obj_size;
+    stats->allocs += pool->live;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/*
+ * Initialize arena with an empty block list.
+ */
+void arena_init(Arena *arena) {
+    arena->block = NULL;
+    arena->block_size = 0;
+    arena->block_used = 0;
+    arena->reserved = 0;
+    arena->used = 0;
+    arena->allocs = 0;
+    pthread_mutex_init(&arena->lock, NULL);
+}
+
+
+/*
+ * Return len bytes from arena, aligned for any type. Exit if memory runs out.
+ */
+void *arena_alloc(Arena *arena, size_t len) {
+    len = align_up(len == 0 ? 1 : len);
+    
+    pthread_mutex_lock(&arena->lock);
+    if (len > ARENA_BLOCK / 4) {
+        // large requests get a block of their own; the current one stays open
+        void *ptr = malloc(len);
+        if (ptr == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        arena->reserved += len;
+        arena->used += len;
+        arena->allocs++;
+        pthread_mutex_unlock(&arena->lock);
+        return ptr;
+    }
+    if (arena->block == NULL || arena->block_used + len > arena->block_size) {
+        // start a new block; the rest of the old one is left unused
+        arena->block = malloc(ARENA_BLOCK);
+        if (arena->block == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        arena->block_size = ARENA_BLOCK;
+        arena->block_used = 0;
+        arena->reserved += ARENA_BLOCK;
+    }
+    void *ptr = arena->block + arena->block_used;
+    arena->block_used += len;
+    arena->used += len;
+    arena->allocs++;
+    pthread_mutex_unlock(&arena->lock);
+    return ptr;
+}
+
+
+/*
+ * Copy the first len bytes of str into arena and NUL-terminate the copy.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+
+/*
+ * Give back len bytes at ptr, which came from arena_alloc on the same arena
+ * with the same len. The memory is only reused if it was the most recent
+ * allocation from the current block or had a block of its own.
+ */
+void arena_free(Arena *arena, void *ptr, size_t len) {
+    len = align_up(len == 0 ? 1 : len);
+
+    pthread_mutex_lock(&arena->lock);
+    if (len > ARENA_BLOCK / 4) {
+        free(ptr);
+        arena->reserved -= len;
+    } else if (arena->block != NULL
+            && (char *)ptr + len == arena->block + arena->block_used) {
+        arena->block_used -= len;
+    } else {
+        // stranded in the middle of a block until the arena goes away
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+    arena->used -= len;
+    arena->allocs--;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+
+/*
+ * Add the memory usage of arena to stats.
+ */
+void arena_stats(Arena *arena, MemStats *stats) {
+    pthread_mutex_lock(&arena->lock);
+    stats->reserved += arena->reserved;
+    stats->used += arena->used;
+    stats->allocs += arena->allocs;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+
+/*
+ * Return a new string from arena with room for len bytes of text and its
+ * NUL, holding one reference. The caller fills in the text before sharing
+ * it.
+ */
+Str *str_new(Arena *arena, int len) {
+    Str *str = arena_alloc(arena, sizeof(Str) + len + 1);
+    str->refs = 1;
+    str->len = len;
+    str->text[len] = '\0';
+    return str;
+}
+
+
+/*
+ * Return a copy of the first len bytes of text as a new string from arena.
+ */
+Str *str_from(Arena *arena, const char *text, int len) {
+    Str *str = str_new(arena, len);
+    memcpy(str->text, text, len);
+    return str;
+}
+
+
+/*
+ * Add a reference to str and return it.
+ */
+Str *str_ref(Str *str) {
+    __atomic_add_fetch(&str->refs, 1, __ATOMIC_RELAXED);
+    return str;
+}
+
+
+/*
+ * Drop a reference to str, which came from arena. When the last reference
+ * goes, its memory is given back with arena_free.
+ */
+void str_release(Arena *arena, Str *str) {
+    if (__atomic_sub_fetch(&str->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        arena_free(arena, str, sizeof(Str) + str->len + 1);
+    }
+}
@@ -0,0 +1,129 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Fixed-size object pool. Objects are carved out of large slabs, and freed
+ * objects go on a free list for reuse, so each allocation costs a pointer
+ * bump or a list pop instead of a malloc with its per-block overhead.
+ */
+typedef struct pool {
+    size_t obj_size;        // size of each object, rounded up for alignment
+    size_t slab_objs;       // objects per slab
+    char *slab;             // slab currently being carved
+    size_t slab_used;       // objects already carved from slab
+    void *free_list;        // freed objects, linked through their first word
+    size_t reserved;        // bytes obtained from malloc
+    size_t live;            // objects currently allocated
+    pthread_mutex_t lock;
+} Pool;
+
+/*
+ * Bump allocator for variable-length data such as post contents. Memory is
+ * handed out from large blocks and only released all at once, which suits
+ * data that lives as long as the server.
+ */
+typedef struct arena {
+    char *block;            // block currently being filled
+    size_t block_size;      // size of block
+    size_t block_used;      // bytes already handed out from block
+    size_t reserved;        // bytes obtained from malloc
+    size_t used;            // bytes handed out
+    size_t allocs;          // number of allocations
+    pthread_mutex_t lock;
+} Arena;
+
+/*
+ * Immutable, reference-counted string allocated from an arena. The text is
+ * written once, right after str_new, and never changed after the string is
+ * shared, so every holder can read it without locking. len is kept so that
+ * nobody has to run strlen over it again.
+ */
+typedef struct str {
+    int refs;               // holders of the string; updated atomically
+    int len;                // length of text, not counting the NUL
+    char text[];            // len bytes followed by a NUL
+} Str;
+
+/*
+ * Memory usage of a set of pools and arenas, in bytes.
+ */
+typedef struct mem_stats {
+    size_t reserved;        // obtained from the system
+    size_t used;            // handed out to live objects and strings
+    size_t allocs;          // live pool objects plus arena allocations
+} MemStats;
+
+/*
+ * Initialize pool to hand out objects of obj_size bytes.
+ */
+void pool_init(Pool *pool, size_t obj_size);
+
+/*
+ * Return a new uninitialized object from pool. Exit if memory runs out.
+ */
+void *pool_alloc(Pool *pool);
+
+/*
+ * Return obj, which came from pool_alloc on the same pool, to pool.
+ */
+void pool_free(Pool *pool, void *obj);
+
+/*
+ * Add the memory usage of pool to stats.
+ */
+void pool_stats(Pool *pool, MemStats *stats);
+
+/*
+ * Initialize arena with an empty block list.
+ */
+void arena_init(Arena *arena);
+
+/*
+ * Return len bytes from arena, aligned for any type. Exit if memory runs out.
+ */
+void *arena_alloc(Arena *arena, size_t len);
+
+/*
+ * Copy the first len bytes of str into arena and NUL-terminate the copy.
+ */
+char *arena_strndup(Arena *arena, const char *str, size_t len);
+
+/*
+ * Give back len bytes at ptr, which came from arena_alloc on the same arena
+ * with the same len. The memory is only reused if it was the most recent
+ * allocation from the current block or had a block of its own.
+ */
+void arena_free(Arena *arena, void *ptr, size_t len);
+
+/*
+ * Add the memory usage of arena to stats.
+ */
+void arena_stats(Arena *arena, MemStats *stats);
+
+/*
+ * Return a new string from arena with room for len bytes of text and its
+ * NUL, holding one reference. The caller fills in the text before sharing
+ * it.
+ */
+Str *str_new(Arena *arena, int len);
+
+/*
+ * Return a copy of the first len bytes of text as a new string from arena.
+ */
+Str *str_from(Arena *arena, const char *text, int len);
+
+/*
+ * Add a reference to str and return it.
+ */
+Str *str_ref(Str *str);
+
+/*
+ * Drop a reference to str, which came from arena. When the last reference
+ * goes, its memory is given back with arena_free.
+ */
+void str_release(Arena *arena, Str *str);
+
+#endif
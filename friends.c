@@ -1,8 +1,308 @@
+#define _GNU_SOURCE
+
 #include "friends.h"
+#include "alloc.h"
+#include "search.h"
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
+
+#define PROFILE_BREAK "------------------------------------------\r\n"
+#define POST_BREAK "\r\n===\r\n\r\n"   // separates posts in a profile
+#define POST_BREAK_LEN 9
+
+
+#define INDEX_MIN_CAP 64   // initial number of slots in the user index
+#define DIR_MIN_CAP 1024   // initial size of the directory buffer
+#define FRIENDS_MIN_ALLOC 4   // initial capacity of a user's friends arrays
+#define DATE_MAX 32        // room for a formatted post date
+#define MUTUAL_MIN_CAP 1024   // initial size of a thread's mutual counts
+#define EXCLUDED UINT_MAX     // mutual count of a user who is no candidate
+
+// the end of a profile header, after the friends list
+#define HEAD_TAIL PROFILE_BREAK "Posts:\r\n"
+#define HEAD_TAIL_LEN (sizeof(HEAD_TAIL) - 1)
+
+// Users and Posts come from slab pools, post contents from a string arena.
+static Pool user_pool;
+static Pool post_pool;
+static Arena text_arena;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// held for reading by every mutation, and for writing by freeze_users
+static pthread_rwlock_t mutation_lock;
+
+// callbacks run after each successful mutation
+static FriendsHooks hooks;
+
+// guards the user list and the index below; taken for writing only to add users
+static pthread_rwlock_t users_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Open-addressing (linear probing) hash index over the user list, keyed on
+ * User.name. Users are never deleted, so no tombstones are needed. The index
+ * belongs to the list whose head is index_head; the list itself is kept so
+ * that list_users still reports users in insertion order.
+ */
+static User **user_index = NULL;
+static unsigned int index_cap = 0;      // always a power of two
+static unsigned int index_count = 0;
+static const User *index_head = NULL;
+static User *index_tail = NULL;         // last user in the list, for O(1) append
+
+/*
+ * Directory of the indexed list: every name followed by "\r\n", in list
+ * order, so that list_users is a copy or a slice instead of a walk. Users
+ * are never deleted, so it only ever grows at the end, and dir_offs[i] is
+ * where the line of the i-th user starts.
+ */
+static char *dir_buf = NULL;
+static int dir_len = 0;
+static int dir_cap = 0;
+static int *dir_offs = NULL;
+static unsigned int dir_offs_cap = 0;
+
+// id of the next user created; guarded by users_lock
+static unsigned int next_user_id = 0;
+
+// seq of the newest post, taken atomically under the target's lock
+static unsigned long last_post_seq = 0;
+
+
+/*
+ * Set up the allocators for users, posts and post contents, and the
+ * mutation lock.
+ */
+static void init_friends(void) {
+    pool_init(&user_pool, sizeof(User));
+    pool_init(&post_pool, sizeof(Post));
+    arena_init(&text_arena);
+
+    // prefer the writer so a snapshot is not starved by a steady stream
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&mutation_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+}
+
+
+/*
+ * Install the callbacks run after every successful create_user,
+ * make_friends and make_post. Any of them may be NULL.
+ */
+void set_friends_hooks(const FriendsHooks *new_hooks) {
+    pthread_once(&init_once, init_friends);
+    pthread_rwlock_wrlock(&mutation_lock);
+    hooks = *new_hooks;
+    pthread_rwlock_unlock(&mutation_lock);
+}
+
+
+/*
+ * Block every mutation until thaw_users is called, so that the whole user
+ * list can be read consistently.
+ */
+void freeze_users(void) {
+    pthread_once(&init_once, init_friends);
+    pthread_rwlock_wrlock(&mutation_lock);
+}
+
+
+/*
+ * Let mutations blocked by freeze_users proceed.
+ */
+void thaw_users(void) {
+    pthread_rwlock_unlock(&mutation_lock);
+}
+
+
+/*
+ * Add the memory held by users, posts and post contents to stats.
+ */
+void memory_usage(MemStats *stats) {
+    pthread_once(&init_once, init_friends);
+    pool_stats(&user_pool, stats);
+    pool_stats(&post_pool, stats);
+    arena_stats(&text_arena, stats);
+    search_memory(stats);
+}
+
+
+/*
+ * Store the number of users and posts in *users and *posts.
+ */
+void object_counts(long *users, long *posts) {
+    MemStats user_stats = {0, 0, 0}, post_stats = {0, 0, 0};
+    pthread_once(&init_once, init_friends);
+    pool_stats(&user_pool, &user_stats);
+    pool_stats(&post_pool, &post_stats);
+    *users = user_stats.allocs;
+    *posts = post_stats.allocs;
+}
+
+
+/*
+ * Return a new post body with room for len bytes of text, holding one
+ * reference for the caller, who fills it in before passing it on.
+ */
+Str *new_post_text(int len) {
+    pthread_once(&init_once, init_friends);
+    return str_new(&text_arena, len);
+}
+
+
+/*
+ * Drop the caller's reference to a post body from new_post_text. A body
+ * that no post took, such as one rejected by make_post, is given back.
+ */
+void release_post_text(Str *text) {
+    str_release(&text_arena, text);
+}
+
+
+/*
+ * Return the FNV-1a hash of a NUL-terminated name.
+ */
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    while (*name != '\0') {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Return the slot holding the user with this name, or the empty slot where
+ * it would be inserted.
+ */
+static User **index_slot(const char *name) {
+    unsigned int mask = index_cap - 1;
+    unsigned int i = hash_name(name) & mask;
+    while (user_index[i] != NULL && strcmp(user_index[i]->name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &user_index[i];
+}
+
+
+/*
+ * Resize the index to new_cap slots and reinsert every indexed user.
+ */
+static void index_resize(unsigned int new_cap) {
+    User **old = user_index;
+    unsigned int old_cap = index_cap;
+
+    user_index = calloc(new_cap, sizeof(User *));
+    if (user_index == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    index_cap = new_cap;
+
+    for (unsigned int i = 0; i < old_cap; i++) {
+        if (old[i] != NULL) {
+            *index_slot(old[i]->name) = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/*
+ * Append the line of user, who becomes user number index_count, to the
+ * directory.
+ */
+static void dir_append(const User *user) {
+    int len = strlen(user->name) + 2;
+    if (dir_len + len > dir_cap) {
+        int new_cap = dir_cap == 0 ? DIR_MIN_CAP : dir_cap * 2;
+        while (new_cap < dir_len + len) {
+            new_cap *= 2;
+        }
+        char *buf = realloc(dir_buf, new_cap);
+        if (buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        dir_buf = buf;
+        dir_cap = new_cap;
+    }
+    if (index_count == dir_offs_cap) {
+        unsigned int new_cap = dir_offs_cap == 0 ? INDEX_MIN_CAP
+            : dir_offs_cap * 2;
+        int *offs = realloc(dir_offs, new_cap * sizeof(int));
+        if (offs == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        dir_offs = offs;
+        dir_offs_cap = new_cap;
+    }
+    dir_offs[index_count] = dir_len;
+    memcpy(dir_buf + dir_len, user->name, len - 2);
+    memcpy(dir_buf + dir_len + len - 2, "\r\n", 2);
+    dir_len += len;
+}
+
+
+/*
+ * Add user to the index and the directory, growing the index to keep the
+ * load factor under 1/2.
+ */
+static void index_insert(User *user) {
+    if ((index_count + 1) * 2 > index_cap) {
+        index_resize(index_cap == 0 ? INDEX_MIN_CAP : index_cap * 2);
+    }
+    *index_slot(user->name) = user;
+    dir_append(user);
+    index_count++;
+    index_tail = user;
+}
+
+
+/*
+ * Point the index at the list starting with head, rebuilding it from
+ * scratch. Only needed when a caller switches to a different list.
+ */
+static void index_rebuild(const User *head) {
+    if (user_index != NULL) {
+        memset(user_index, 0, index_cap * sizeof(User *));
+    }
+    index_count = 0;
+    index_tail = NULL;
+    index_head = head;
+    dir_len = 0;
+
+    while (head != NULL) {
+        index_insert((User *)head);
+        head = head->next;
+    }
+}
+
+
+/*
+ * find_user without locking; the caller must hold users_lock.
+ */
+static User *lookup_user(const char *name, const User *head) {
+    if (head != NULL && head == index_head) {   // O(1) lookup in the index
+        return *index_slot(name);
+    }
+
+    // list the index doesn't cover; fall back to a linear scan
+    while (head != NULL && strcmp(name, head->name) != 0) {
+        head = head->next;
+    }
 
+    return (User *)head;
+}
+
+
+static void render_profile_head(User *user);
 
 /*
  * Create a new user with the given name.  Insert it at the tail of the list 
@@ -19,11 +319,20 @@ int create_user(const char *name, User **user_ptr_add) {
         return 2;
     }
 
-    User *new_user = malloc(sizeof(User));
-    if (new_user == NULL) {
-        perror("malloc");
-        exit(1);
+    pthread_once(&init_once, init_friends);
+    pthread_rwlock_rdlock(&mutation_lock);
+    pthread_rwlock_wrlock(&users_lock);
+    if (index_head != *user_ptr_add || *user_ptr_add == NULL) {
+        index_rebuild(*user_ptr_add);
     }
+
+    if (lookup_user(name, *user_ptr_add) != NULL) {
+        pthread_rwlock_unlock(&users_lock);
+        pthread_rwlock_unlock(&mutation_lock);
+        return 1;
+    }
+
+    User *new_user = pool_alloc(&user_pool);
     strncpy(new_user->name, name, MAX_NAME); // name has max length MAX_NAME - 1
 
     for (int i = 0; i < MAX_NAME; i++) {
@@ -32,28 +341,46 @@ int create_user(const char *name, User **user_ptr_add) {
 
     new_user->first_post = NULL;
     new_user->next = NULL;
-    for (int i = 0; i < MAX_FRIENDS; i++) {
-        new_user->friends[i] = NULL;
-    }
+    new_user->id = next_user_id++;
+    pthread_mutex_init(&new_user->lock, NULL);
 
-    // Add user to list
-    User *prev = NULL;
-    User *curr = *user_ptr_add;
-    while (curr != NULL && strcmp(curr->name, name) != 0) {
-        prev = curr;
-        curr = curr->next;
-    }
+    new_user->friends = NULL;
+    new_user->friend_ids = NULL;
+    new_user->num_friends = 0;
+    new_user->friends_alloc = 0;
 
-    if (*user_ptr_add == NULL) {       // bug fixed 03/04/2016. Now correct on repeat of 1st name
-        *user_ptr_add = new_user;
-        return 0;
-    } else if (curr != NULL) {
-        free(new_user);
-        return 1;
+    new_user->profile_head = NULL;
+    new_user->head_cap = 0;
+    new_user->posts_buf = NULL;
+    new_user->posts_cap = 0;
+    new_user->posts_start = 0;
+    new_user->posts = NULL;
+    new_user->num_posts = 0;
+    new_user->posts_alloc = 0;
+    new_user->suggestions = NULL;
+    new_user->num_suggestions = 0;
+    new_user->suggest_version = 1;   // nothing ranked yet
+    new_user->suggest_built = 0;
+    new_user->feed = NULL;
+    new_user->feed_len = 0;
+    new_user->feed_seen = NULL;
+    new_user->feed_sources = 0;
+    render_profile_head(new_user);
+
+    // Add user to the tail of the list and to the index
+    if (*user_ptr_add == NULL) {
+        __atomic_store_n(user_ptr_add, new_user, __ATOMIC_RELEASE);
+        index_head = new_user;
     } else {
-        prev->next = new_user;
-        return 0;
+        index_tail->next = new_user;
     }
+    index_insert(new_user);
+    if (hooks.user_created != NULL) {
+        hooks.user_created(new_user);
+    }
+    pthread_rwlock_unlock(&users_lock);
+    pthread_rwlock_unlock(&mutation_lock);
+    return 0;
 }
 
 
@@ -65,18 +392,10 @@ int create_user(const char *name, User **user_ptr_add) {
  * to satisfy the prototype without warnings.
  */
 User *find_user(const char *name, const User *head) {
-/*    const User *curr = head;
-    while (curr != NULL && strcmp(name, curr->name) != 0) {
-        curr = curr->next;
-    }
-
-    return (User *)curr;
-*/
-    while (head != NULL && strcmp(name, head->name) != 0) {
-        head = head->next;
-    }
-
-    return (User *)head;
+    pthread_rwlock_rdlock(&users_lock);
+    User *user = lookup_user(name, head);
+    pthread_rwlock_unlock(&users_lock);
+    return user;
 }
 
 
@@ -85,6 +404,20 @@ User *find_user(const char *name, const User *head) {
  * in the list, one per line, starting at curr.
  */
 char *list_users(const User *curr) {
+    pthread_rwlock_rdlock(&users_lock);
+    if (curr != NULL && curr == index_head) {
+        // the directory already holds exactly this string
+        char *buf = malloc(dir_len + 1);
+        if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(buf, dir_buf, dir_len);
+        buf[dir_len] = '\0';
+        pthread_rwlock_unlock(&users_lock);
+        return buf;
+    }
+
     int buf_len = 1;
     const User *head = curr;
     
@@ -97,22 +430,69 @@ char *list_users(const User *curr) {
     curr = head;                    // go back to the head of the list
     int len = 0;                    // track length of buf
     char *buf = malloc(buf_len);    // allocate buffer of sufficient size
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
     
     // add all usernames in list to allocated string
     while (curr != NULL) {
         len += snprintf(buf + len, buf_len - len, "%s\r\n", curr->name);
         curr = curr->next;
     }
+    buf[len] = '\0';
+    pthread_rwlock_unlock(&users_lock);
     
     return buf; // return pointer to string listing all users
 }
 
 
+/*
+ * Pass the names of at most limit users of the list starting at head,
+ * skipping the first cursor, to sink, one per line. A negative limit
+ * includes every user after cursor. Return the number of users in the list.
+ */
+int send_users(const User *head, int cursor, int limit, ProfileSink sink,
+        void *arg) {
+    pthread_rwlock_rdlock(&users_lock);
+    if (head != NULL && head == index_head) {
+        // one slice of the directory, without copying it
+        int count = index_count;
+        int first = cursor < count ? cursor : count;
+        int last = limit < 0 || limit > count - first ? count : first + limit;
+        if (last > first) {
+            struct iovec iov;
+            iov.iov_base = dir_buf + dir_offs[first];
+            iov.iov_len = (last < count ? dir_offs[last] : dir_len)
+                - dir_offs[first];
+            sink(arg, &iov, 1);
+        }
+        pthread_rwlock_unlock(&users_lock);
+        return count;
+    }
+
+    // list the directory doesn't cover; walk it
+    int count = 0;
+    for (const User *curr = head; curr != NULL; curr = curr->next, count++) {
+        if (count >= cursor && (limit < 0 || count < cursor + limit)) {
+            struct iovec iov[2];
+            iov[0].iov_base = (void *)curr->name;
+            iov[0].iov_len = strlen(curr->name);
+            iov[1].iov_base = "\r\n";
+            iov[1].iov_len = 2;
+            sink(arg, iov, 2);
+        }
+    }
+    pthread_rwlock_unlock(&users_lock);
+    return count;
+}
+
+
 /* 
  * Make two users friends with each other.  This is symmetric - a pointer to 
  * each user must be stored in the 'friends' array of the other.
  *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * New friends are appended to the 'friends' array, which grows as needed.
  *
  * Return:
  *   - 0 on success.
@@ -125,6 +505,8 @@ char *list_users(const User *curr) {
  * Do not modify either user if the result is a failure.
  * NOTE: If multiple errors apply, return the *largest* error code that applies.
  */
+static int link_friends(User *user1, User *user2);
+
 int make_friends(const char *name1, const char *name2, User *head) {
     User *user1 = find_user(name1, head);
     User *user2 = find_user(name2, head);
@@ -135,102 +517,870 @@ int make_friends(const char *name1, const char *name2, User *head) {
         return 3;
     }
 
-    int i, j;
-    for (i = 0; i < MAX_FRIENDS; i++) {
-        if (user1->friends[i] == NULL) { // Empty spot
-            break;
-        } else if (user1->friends[i] == user2) { // Already friends.
-            return 1;
+    // lock both users in address order so concurrent calls cannot deadlock
+    User *first = user1 < user2 ? user1 : user2;
+    User *second = user1 < user2 ? user2 : user1;
+    pthread_rwlock_rdlock(&mutation_lock);
+    pthread_mutex_lock(&first->lock);
+    pthread_mutex_lock(&second->lock);
+
+    int result = link_friends(user1, user2);
+    if (result == 0 && hooks.friends_made != NULL) {
+        hooks.friends_made(user1, user2);
+    }
+
+    pthread_mutex_unlock(&second->lock);
+    pthread_mutex_unlock(&first->lock);
+    pthread_rwlock_unlock(&mutation_lock);
+    return result;
+}
+
+
+/*
+ * Return the position of id in user's sorted friend_ids, or where it would
+ * be inserted if it is not there. The caller must hold user->lock.
+ */
+static int friend_slot(const User *user, unsigned int id) {
+    int lo = 0, hi = user->num_friends;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (user->friend_ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
+
+
+/*
+ * Return 1 if friend is among user's friends. The caller must hold
+ * user->lock.
+ */
+static int has_friend(const User *user, const User *friend) {
+    int i = friend_slot(user, friend->id);
+    return i < user->num_friends && user->friend_ids[i] == friend->id;
+}
 
-    for (j = 0; j < MAX_FRIENDS; j++) {
-        if (user2->friends[j] == NULL) { // Empty spot
-            break;
-        } 
+
+/*
+ * Return 1 if user1 and user2 are friends, 0 otherwise, in O(log n) time
+ * for n friends of user1.
+ */
+int are_friends(const User *user1, const User *user2) {
+    pthread_mutex_lock((pthread_mutex_t *)&user1->lock);
+    int result = has_friend(user1, user2);
+    pthread_mutex_unlock((pthread_mutex_t *)&user1->lock);
+    return result;
+}
+
+
+/*
+ * Add friend to user's friends, one way only, growing both arrays as
+ * needed. friend must not already be there. The caller must hold
+ * user->lock.
+ */
+static void add_friend(User *user, User *friend) {
+    if (user->num_friends == user->friends_alloc) {
+        int new_alloc = user->friends_alloc == 0 ? FRIENDS_MIN_ALLOC
+            : user->friends_alloc * 2;
+        User **friends = realloc(user->friends, new_alloc * sizeof(User *));
+        unsigned int *ids = friends == NULL ? NULL
+            : realloc(user->friend_ids, new_alloc * sizeof(unsigned int));
+        if (ids == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        user->friends = friends;
+        user->friend_ids = ids;
+        user->friends_alloc = new_alloc;
     }
 
-    if (i == MAX_FRIENDS || j == MAX_FRIENDS) { // Too many friends.
+    int i = friend_slot(user, friend->id);
+    memmove(&user->friend_ids[i + 1], &user->friend_ids[i],
+        (user->num_friends - i) * sizeof(unsigned int));
+    user->friend_ids[i] = friend->id;
+    user->friends[user->num_friends++] = friend;
+}
+
+
+/*
+ * Add the line of friend, the newest of user's friends, to the end of the
+ * friends list in user's cached profile header. The caller must hold
+ * user->lock.
+ */
+static void render_profile_friend(User *user, const User *friend) {
+    int name_len = strlen(friend->name);
+    int need = user->head_len + name_len + 2 + 1;
+    if (need > user->head_cap) {
+        int new_cap = user->head_cap * 2 > need ? user->head_cap * 2 : need;
+        char *buf = realloc(user->profile_head, new_cap);
+        if (buf == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        user->profile_head = buf;
+        user->head_cap = new_cap;
+    }
+
+    // shift the closing break and "Posts:" line along, with the terminator
+    char *tail = user->profile_head + user->head_len - HEAD_TAIL_LEN;
+    memmove(tail + name_len + 2, tail, HEAD_TAIL_LEN + 1);
+    memcpy(tail, friend->name, name_len);
+    memcpy(tail + name_len, "\r\n", 2);
+    user->head_len += name_len + 2;
+}
+
+
+/*
+ * Mark the cached suggestions of every friend of user out of date. A new
+ * friendship between user and someone changes the mutual counts of exactly
+ * the friends of both, so make_friends calls this for each of them, with
+ * the new friend already added. The caller must hold user->lock.
+ */
+static void invalidate_suggestions(const User *user) {
+    for (int i = 0; i < user->num_friends; i++) {
+        __atomic_add_fetch(&user->friends[i]->suggest_version, 1,
+            __ATOMIC_RELEASE);
+    }
+}
+
+
+/*
+ * Add user1 and user2 to each other's friends arrays. Both users must be
+ * locked by the caller. Return the make_friends error code.
+ */
+static int link_friends(User *user1, User *user2) {
+    if (has_friend(user1, user2)) { // Already friends.
+        return 1;
+    }
+    if (user1->num_friends == MAX_FRIENDS
+            || user2->num_friends == MAX_FRIENDS) { // Too many friends.
         return 2;
     }
 
-    user1->friends[i] = user2;
-    user2->friends[j] = user1;
+    add_friend(user1, user2);
+    add_friend(user2, user1);
+    render_profile_friend(user1, user2);
+    render_profile_friend(user2, user1);
+    invalidate_suggestions(user1);
+    invalidate_suggestions(user2);
     return 0;
 }
 
 
-/* 
- * Return a pointer to a dynamically allocated string holding a user profile.
+/*
+ * Scratch space for ranking suggestions, one set per thread so workers can
+ * rank concurrently. mutual[id] counts the friends the user with that id
+ * shares with the user being served, or is EXCLUDED for that user and its
+ * friends, and candidates lists every user with a nonzero count. Every
+ * entry set is reset afterwards, so the arrays are only cleared as they
+ * grow.
  */
-char *print_user(const User *user) {
+static __thread unsigned int *mutual = NULL;
+static __thread unsigned int mutual_cap = 0;
+static __thread const User **candidates = NULL;
+static __thread int candidates_cap = 0;
+
+
+/*
+ * Return this thread's mutual count for id, growing the array to hold it.
+ */
+static unsigned int *mutual_count(unsigned int id) {
+    if (id >= mutual_cap) {
+        unsigned int new_cap = mutual_cap == 0 ? MUTUAL_MIN_CAP : mutual_cap;
+        while (new_cap <= id) {
+            new_cap *= 2;
+        }
+        unsigned int *counts = realloc(mutual, new_cap * sizeof(unsigned int));
+        if (counts == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        memset(counts + mutual_cap, 0,
+            (new_cap - mutual_cap) * sizeof(unsigned int));
+        mutual = counts;
+        mutual_cap = new_cap;
+    }
+    return &mutual[id];
+}
+
+
+/*
+ * Return 1 if suggestion a ranks above suggestion b.
+ */
+static int ranks_above(const Suggestion *a, const Suggestion *b) {
+    return a->mutual > b->mutual
+        || (a->mutual == b->mutual && a->user->id < b->user->id);
+}
+
+
+/*
+ * Restore the heap order of the count suggestions in heap below i. The
+ * lowest ranked suggestion is at the root.
+ */
+static void sift_down(Suggestion *heap, int count, int i) {
+    while (1) {
+        int lowest = i;
+        int left = 2 * i + 1, right = left + 1;
+        if (left < count && ranks_above(&heap[lowest], &heap[left])) {
+            lowest = left;
+        }
+        if (right < count && ranks_above(&heap[lowest], &heap[right])) {
+            lowest = right;
+        }
+        if (lowest == i) {
+            return;
+        }
+        Suggestion tmp = heap[i];
+        heap[i] = heap[lowest];
+        heap[lowest] = tmp;
+        i = lowest;
+    }
+}
+
+
+/*
+ * Rank the users who share friends with user, and store the best
+ * SUGGEST_MAX of them in out, best first. Friends of friends are counted by
+ * walking each friend's friends once, so the cost is the sum of the
+ * friends' friend counts; only one user is locked at a time.
+ * Return the number stored.
+ */
+static int rank_suggestions(User *user, Suggestion *out) {
+    pthread_mutex_lock(&user->lock);
+    int num_friends = user->num_friends;
+    User **friends = malloc((num_friends + 1) * sizeof(User *));
+    if (friends == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(friends, user->friends, num_friends * sizeof(User *));
+    pthread_mutex_unlock(&user->lock);
+
+    // the user and its friends are never candidates
+    friends[num_friends] = user;
+    for (int i = 0; i <= num_friends; i++) {
+        *mutual_count(friends[i]->id) = EXCLUDED;
+    }
+
+    int num_candidates = 0;
+    for (int i = 0; i < num_friends; i++) {
+        User *friend = friends[i];
+        pthread_mutex_lock(&friend->lock);
+        if (num_candidates + friend->num_friends > candidates_cap) {
+            int new_cap = candidates_cap == 0 ? MUTUAL_MIN_CAP
+                : candidates_cap;
+            while (new_cap < num_candidates + friend->num_friends) {
+                new_cap *= 2;
+            }
+            const User **list = realloc(candidates,
+                new_cap * sizeof(User *));
+            if (list == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            candidates = list;
+            candidates_cap = new_cap;
+        }
+        for (int j = 0; j < friend->num_friends; j++) {
+            const User *candidate = friend->friends[j];
+            unsigned int *count = mutual_count(candidate->id);
+            if (*count == EXCLUDED) {
+                continue;
+            }
+            if ((*count)++ == 0) {
+                candidates[num_candidates++] = candidate;
+            }
+        }
+        pthread_mutex_unlock(&friend->lock);
+    }
+
+    // keep the best SUGGEST_MAX in a heap whose root is the worst of them
+    int num_out = 0;
+    for (int i = 0; i < num_candidates; i++) {
+        unsigned int *count = &mutual[candidates[i]->id];
+        Suggestion next = {candidates[i], *count};
+        *count = 0;
+        if (num_out < SUGGEST_MAX) {
+            out[num_out++] = next;
+            if (num_out == SUGGEST_MAX) {
+                for (int j = SUGGEST_MAX / 2 - 1; j >= 0; j--) {
+                    sift_down(out, SUGGEST_MAX, j);
+                }
+            }
+        } else if (ranks_above(&next, &out[0])) {
+            out[0] = next;
+            sift_down(out, SUGGEST_MAX, 0);
+        }
+    }
+    for (int i = 0; i <= num_friends; i++) {
+        mutual[friends[i]->id] = 0;
+    }
+    free(friends);
+
+    // heapsort what is left, best first
+    if (num_out < SUGGEST_MAX) {
+        for (int j = num_out / 2 - 1; j >= 0; j--) {
+            sift_down(out, num_out, j);
+        }
+    }
+    for (int n = num_out - 1; n > 0; n--) {
+        Suggestion tmp = out[0];
+        out[0] = out[n];
+        out[n] = tmp;
+        sift_down(out, n, 0);
+    }
+    return num_out;
+}
+
+
+/*
+ * Store in out up to k of the users who are not friends with user but share
+ * at least one friend with it, most mutual friends first and, among equals,
+ * oldest user first. k is capped at SUGGEST_MAX. The ranking is cached and
+ * only redone after make_friends changes a count it depends on.
+ * Return the number of suggestions stored.
+ */
+int suggest_friends(User *user, int k, Suggestion *out) {
+    if (k > SUGGEST_MAX) {
+        k = SUGGEST_MAX;
+    }
+
+    unsigned int version = __atomic_load_n(&user->suggest_version,
+        __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&user->lock);
+    if (user->suggest_built != version) {
+        pthread_mutex_unlock(&user->lock);
+        Suggestion ranked[SUGGEST_MAX];
+        int count = rank_suggestions(user, ranked);
+
+        // keep whichever ranking is newer if another thread stored one
+        pthread_mutex_lock(&user->lock);
+        if ((int)(version - user->suggest_built) > 0) {
+            if (user->suggestions == NULL) {
+                user->suggestions = malloc(SUGGEST_MAX * sizeof(Suggestion));
+                if (user->suggestions == NULL) {
+                    perror("malloc");
+                    exit(1);
+                }
+            }
+            memcpy(user->suggestions, ranked, count * sizeof(Suggestion));
+            user->num_suggestions = count;
+            user->suggest_built = version;
+        }
+    }
+
+    int count = user->num_suggestions < k ? user->num_suggestions : k;
+    if (count > 0) {
+        memcpy(out, user->suggestions, count * sizeof(Suggestion));
+    }
+    pthread_mutex_unlock(&user->lock);
+    return count;
+}
+
+
+/*
+ * Append friend to user's friends array, one way only, without running
+ * hooks or re-rendering the profile. Used to rebuild saved state; call
+ * refresh_profile once the user's friends are all restored.
+ * Return 0 on success, 1 if user already has MAX_FRIENDS friends or is
+ * already friends with friend.
+ */
+int restore_friend(User *user, User *friend) {
+    pthread_mutex_lock(&user->lock);
+    int result = 1;
+    if (user->num_friends < MAX_FRIENDS && !has_friend(user, friend)) {
+        add_friend(user, friend);
+        result = 0;
+    }
+    pthread_mutex_unlock(&user->lock);
+    return result;
+}
+
+
+/*
+ * Re-render the cached profile header of user from its friends array.
+ */
+void refresh_profile(User *user) {
+    pthread_mutex_lock(&user->lock);
+    render_profile_head(user);
+    pthread_mutex_unlock(&user->lock);
+}
+
+
+/*
+ * Rebuild the cached header of user's profile: the name and the friends
+ * list, up to and including the "Posts:" line. The caller must hold
+ * user->lock.
+ */
+static void render_profile_head(User *user) {
     int buf_len = 1;                    // 1 for null terminator
     buf_len += 8 + strlen(user->name);  // "Name: \r\n"     8 characters
     buf_len += 10;                      // "Friends:\r\n"   10 characters
     buf_len += 8;                       // "Posts:\r\n"     8 characters
-    buf_len += 44 * 3;                  // dashed break     44 characters
-    
+    buf_len += 44 * 2;                  // dashed break     44 characters
     
     // add length of each friend's name
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
+    for (int i = 0; i < user->num_friends; i++) {
         buf_len += strlen(user->friends[i]->name) + 2;
     }
-    
-    // add length of all posts
-    const Post *curr = user->first_post;
-    while (curr != NULL) {
-        // add lengths of author, date, and message
-        buf_len += strlen(curr->author) + 8;
-        buf_len += strlen(asctime(localtime(curr->date))) + 8;
-        buf_len += strlen(curr->contents) + 2;
-        curr = curr->next;
-        if (curr != NULL) {
-            buf_len += strlen("\r\n===\r\n\r\n"); // 9
-        }
-    }
 
-    int len = 0;                    // track length of buf
-    char *buf = malloc(buf_len);    // allocate buffer of sufficient size
-    curr = user->first_post;        // go back to head of list
+    int len = 0;                        // track length of buf
+    char *buf = realloc(user->profile_head, buf_len);
+    if (buf == NULL) {
+        perror("realloc");
+        exit(1);
+    }
     
     // Add name
     len += snprintf(buf + len, buf_len - len, "Name: %s\r\n", user->name);
-    len += snprintf(buf + len, buf_len - len,
-                "------------------------------------------\r\n");
+    len += snprintf(buf + len, buf_len - len, "%s", PROFILE_BREAK);
 
     // Add friends list.
     len += snprintf(buf + len, buf_len - len, "Friends:\r\n");
-    for (int i = 0; i < MAX_FRIENDS && user->friends[i] != NULL; i++) {
+    for (int i = 0; i < user->num_friends; i++) {
         len += snprintf(buf + len, buf_len - len, "%s\r\n", user->friends[i]->name);
     }
-    len += snprintf(buf + len, buf_len - len,
-                "------------------------------------------\r\n");
+    len += snprintf(buf + len, buf_len - len, "%s", HEAD_TAIL);
 
-    // Add post list.
-    len += snprintf(buf + len, buf_len - len, "Posts:\r\n");
-    while (curr != NULL) {
-        // Add author
-        len += snprintf(buf + len, buf_len - len, "From: %s\r\n", curr->author);
+    user->profile_head = buf;
+    user->head_len = len;
+    user->head_cap = buf_len;
+}
+
+
+/*
+ * Write date into buf, which holds DATE_MAX bytes, in the format of
+ * asctime ("Sat Oct 17 17:52:50 2026\n") and return its length. Posts made
+ * in the same second share one conversion: each thread keeps the last date
+ * it formatted, so bursts of posts and log replay skip localtime_r.
+ */
+static int format_date(time_t date, char *buf) {
+    static __thread time_t cached_date = -1;
+    static __thread char cached[DATE_MAX];
+    static __thread int cached_len = 0;
+
+    if (date != cached_date) {
+        struct tm tm;
+        if (localtime_r(&date, &tm) == NULL) {
+            return snprintf(buf, DATE_MAX, "%lld\n", (long long)date);
+        }
+        cached_len = strftime(cached, DATE_MAX, "%a %b %e %H:%M:%S %Y\n", &tm);
+        cached_date = date;
+    }
+    memcpy(buf, cached, cached_len + 1);
+    return cached_len;
+}
+
+
+/*
+ * Prepend the rendering of post, the newest post of user, to the cached
+ * posts section of user's profile. The section is kept at the end of
+ * posts_buf so that prepending only copies the new text. The caller must
+ * hold user->lock.
+ */
+static void render_profile_post(User *user, Post *post) {
+    char date[DATE_MAX];
+    format_date(post->date, date);
     
-        // Add date
-        char *time = asctime(localtime(curr->date));
-        len += snprintf(buf + len, buf_len - len, "Date: %s\r\n", time);
+    // the header is short; the contents are copied in with their known length
+    char head[MAX_NAME + 48];
+    int head_len = snprintf(head, sizeof(head), "From: %s\r\nDate: %s\r\n",
+        post->author, date);
+    const Str *contents = post->contents;
+    int text_len = head_len + contents->len + 2;    // message "\r\n" 2
+    int sep_len = user->posts_cap > user->posts_start ? POST_BREAK_LEN : 0;
+    int need = text_len + sep_len;
 
-        // Add message
-        len += snprintf(buf + len, buf_len - len, "%s\r\n", curr->contents);
-        
-        curr = curr->next;
-        if (curr != NULL) {
-            len += snprintf(buf + len, buf_len - len, "\r\n===\r\n\r\n");
+    // grow the buffer, keeping the section right-aligned
+    if (need > user->posts_start) {
+        int used = user->posts_cap - user->posts_start;
+        int new_cap = user->posts_cap == 0 ? 1024 : user->posts_cap * 2;
+        while (new_cap - used < need) {
+            new_cap *= 2;
         }
+        char *buf = malloc(new_cap);
+        if (buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(buf + new_cap - used, user->posts_buf + user->posts_start, used);
+        free(user->posts_buf);
+        user->posts_buf = buf;
+        user->posts_cap = new_cap;
+        user->posts_start = new_cap - used;
+    }
+
+    user->posts_start -= need;
+    char *out = user->posts_buf + user->posts_start;
+    memcpy(out, head, head_len);
+    memcpy(out + head_len, contents->text, contents->len);
+    memcpy(out + head_len + contents->len, "\r\n", 2);
+    memcpy(out + text_len, POST_BREAK, sep_len);
+    
+    // the distance to the end of the buffer survives later growth
+    post->tail_off = user->posts_cap - user->posts_start;
+}
+
+
+/*
+ * Fill iov with the cached profile of user, showing at most limit posts
+ * starting offset posts back from the newest; a negative limit shows them
+ * all. The page is a contiguous slice of the posts section, found through
+ * the posts index in O(1). The caller must hold user->lock, and the memory
+ * is only valid until it is released.
+ */
+static int profile_iov(const User *user, int offset, int limit,
+        struct iovec *iov) {
+    char *end = user->posts_buf + user->posts_cap;
+    int newest = user->num_posts - 1 - offset;          // index of first shown
+    int oldest = limit < 0 ? 0 : newest - limit + 1;    // index of last shown
+    if (oldest < 0) {
+        oldest = 0;
     }
-    len += snprintf(buf + len, buf_len - len,
-                "------------------------------------------\r\n");
+    
+    iov[0].iov_base = user->profile_head;
+    iov[0].iov_len = user->head_len;
+    if (newest < oldest) {  // page past the oldest post
+        iov[1].iov_base = end;
+        iov[1].iov_len = 0;
+    } else {
+        char *first = end - user->posts[newest]->tail_off;
+        // stop before the separator that precedes the next older post
+        char *last = oldest == 0 ? end
+                : end - user->posts[oldest - 1]->tail_off - POST_BREAK_LEN;
+        iov[1].iov_base = first;
+        iov[1].iov_len = last - first;
+    }
+    iov[2].iov_base = PROFILE_BREAK;
+    iov[2].iov_len = strlen(PROFILE_BREAK);
+    return 3;
+}
+
+
+/* 
+ * Return a pointer to a dynamically allocated string holding a user profile.
+ */
+char *print_user(const User *user) {
+    pthread_mutex_lock((pthread_mutex_t *)&user->lock);
+    
+    struct iovec iov[3];
+    int iovcnt = profile_iov(user, 0, -1, iov);
+    
+    int buf_len = 1;                    // 1 for null terminator
+    for (int i = 0; i < iovcnt; i++) {
+        buf_len += iov[i].iov_len;
+    }
+    
+    int len = 0;                    // track length of buf
+    char *buf = malloc(buf_len);    // allocate buffer of sufficient size
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    buf[len] = '\0';
+    
+    pthread_mutex_unlock((pthread_mutex_t *)&user->lock);
 
     return buf;
 }
 
 
+/*
+ * Pass the cached profile of user to sink as an iovec array, without
+ * copying it. The user is locked while sink runs, so sink must not block
+ * or call back into this module.
+ */
+void send_user(const User *user, ProfileSink sink, void *arg) {
+    send_user_page(user, 0, -1, sink, arg);
+}
+
+
+/*
+ * Like send_user, but include at most limit posts, skipping the offset
+ * newest ones. A negative limit includes every post after offset.
+ */
+void send_user_page(const User *user, int offset, int limit,
+        ProfileSink sink, void *arg) {
+    pthread_mutex_lock((pthread_mutex_t *)&user->lock);
+    struct iovec iov[3];
+    int iovcnt = profile_iov(user, offset, limit, iov);
+    sink(arg, iov, iovcnt);
+    pthread_mutex_unlock((pthread_mutex_t *)&user->lock);
+}
+
+
+/*
+ * One newest-first run of posts in a feed merge. A run over a source
+ * user's posts index walks down from next to stop; a run over the cached
+ * feed (source NULL) walks up from next to stop. head is the newest post
+ * of the run not merged yet.
+ */
+typedef struct feed_run {
+    User *source;
+    const FeedItem *cached;
+    int next;
+    int stop;
+    FeedItem head;
+} FeedRun;
+
+
+/*
+ * Return 1 if a was posted after b.
+ */
+static int newer(const FeedItem *a, const FeedItem *b) {
+    return a->post->date > b->post->date
+        || (a->post->date == b->post->date && a->post->seq > b->post->seq);
+}
+
+
+/*
+ * Load the next post of run into its head. The posts index only grows at
+ * the end, but it may be reallocated, so a source is locked to read it.
+ * Return 0 if the run is exhausted, 1 otherwise.
+ */
+static int run_advance(FeedRun *run) {
+    if (run->source == NULL) {
+        if (run->next == run->stop) {
+            return 0;
+        }
+        run->head = run->cached[run->next++];
+        return 1;
+    }
+    if (run->next < run->stop) {
+        return 0;
+    }
+    pthread_mutex_lock(&run->source->lock);
+    run->head.post = run->source->posts[run->next--];
+    pthread_mutex_unlock(&run->source->lock);
+    run->head.target = run->source;
+    return 1;
+}
+
+
+/*
+ * Restore the heap order of the count runs in heap below i, so that the run
+ * with the newest head is at the root.
+ */
+static void sift_down_runs(FeedRun **heap, int count, int i) {
+    while (1) {
+        int newest = i;
+        int left = 2 * i + 1, right = left + 1;
+        if (left < count && newer(&heap[left]->head, &heap[newest]->head)) {
+            newest = left;
+        }
+        if (right < count && newer(&heap[right]->head, &heap[newest]->head)) {
+            newest = right;
+        }
+        if (newest == i) {
+            return;
+        }
+        FeedRun *tmp = heap[i];
+        heap[i] = heap[newest];
+        heap[newest] = tmp;
+        i = newest;
+    }
+}
+
+
+/*
+ * Bring the cached feed of user up to date and copy it into out. Only the
+ * sources with posts the cache has not seen are merged, together with the
+ * cache itself, in a k-way merge over a heap of runs; a source contributes
+ * at most its FEED_MAX newest unseen posts, and the merge stops after
+ * FEED_MAX posts. Checking for new posts reads each source's post count
+ * without locking it, so an unchanged feed costs one pass over the friends.
+ * Return the number of posts copied.
+ */
+static int refresh_feed(User *user, FeedItem *out) {
+    pthread_mutex_lock(&user->lock);
+    int num_sources = user->num_friends + 1;
+    User **sources = malloc(num_sources * sizeof(User *));
+    int *seen = malloc(num_sources * sizeof(int));
+    if (sources == NULL || seen == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    sources[0] = user;
+    memcpy(sources + 1, user->friends, user->num_friends * sizeof(User *));
+    for (int i = 0; i < num_sources; i++) {
+        seen[i] = i < user->feed_sources ? user->feed_seen[i] : 0;
+    }
+    int cached_len = user->feed_len;
+    FeedItem cached[FEED_MAX];
+    if (cached_len > 0) {
+        memcpy(cached, user->feed, cached_len * sizeof(FeedItem));
+    }
+    int complete = user->feed_sources == num_sources;
+    pthread_mutex_unlock(&user->lock);
+
+    // one run per source with unseen posts, and one for the cache
+    FeedRun *runs = malloc((num_sources + 1) * sizeof(FeedRun));
+    FeedRun **heap = malloc((num_sources + 1) * sizeof(FeedRun *));
+    if (runs == NULL || heap == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    int num_runs = 0;
+    for (int i = 0; i < num_sources; i++) {
+        int num_posts = __atomic_load_n(&sources[i]->num_posts,
+            __ATOMIC_ACQUIRE);
+        if (num_posts == seen[i]) {
+            continue;
+        }
+        int stop = num_posts - FEED_MAX > seen[i] ? num_posts - FEED_MAX
+            : seen[i];
+        runs[num_runs] = (FeedRun){sources[i], NULL, num_posts - 1, stop};
+        seen[i] = num_posts;
+        num_runs++;
+    }
+
+    if (num_runs == 0 && complete) {    // nothing new since the last merge
+        free(runs);
+        free(heap);
+        free(sources);
+        free(seen);
+        memcpy(out, cached, cached_len * sizeof(FeedItem));
+        return cached_len;
+    }
+    runs[num_runs++] = (FeedRun){NULL, cached, 0, cached_len};
+
+    int heap_len = 0;
+    for (int i = 0; i < num_runs; i++) {
+        if (run_advance(&runs[i])) {
+            heap[heap_len++] = &runs[i];
+        }
+    }
+    for (int i = heap_len / 2 - 1; i >= 0; i--) {
+        sift_down_runs(heap, heap_len, i);
+    }
+    int len = 0;
+    while (heap_len > 0 && len < FEED_MAX) {
+        out[len++] = heap[0]->head;
+        if (!run_advance(heap[0])) {
+            heap[0] = heap[--heap_len];
+        }
+        sift_down_runs(heap, heap_len, 0);
+    }
+    free(runs);
+    free(heap);
+    free(sources);
+
+    // any merge is consistent with its own counts, so the last one stored
+    // is a valid cache even if merges raced
+    pthread_mutex_lock(&user->lock);
+    if (user->feed == NULL) {
+        user->feed = malloc(FEED_MAX * sizeof(FeedItem));
+        if (user->feed == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    memcpy(user->feed, out, len * sizeof(FeedItem));
+    user->feed_len = len;
+    free(user->feed_seen);
+    user->feed_seen = seen;
+    user->feed_sources = num_sources;
+    pthread_mutex_unlock(&user->lock);
+    return len;
+}
+
+
+/*
+ * Pass the newest n posts on the profiles of user and all of its friends,
+ * newest first, to sink as an iovec array; the contents are not copied.
+ * n is capped at FEED_MAX. The feed is cached and refreshed by merging in
+ * only the posts made since, so sink runs with no user locked.
+ * Return the number of posts passed.
+ */
+int send_feed(User *user, int n, ProfileSink sink, void *arg) {
+    FeedItem items[FEED_MAX];
+    int count = refresh_feed(user, items);
+    if (n < count) {
+        count = n;
+    }
+    if (count <= 0) {
+        return 0;
+    }
+    send_posts(items, count, sink, arg);
+    return count;
+}
+
+
+/*
+ * Pass the count posts in items to sink as an iovec array, in order, each
+ * with its author, target and date; the contents are not copied.
+ */
+void send_posts(const FeedItem *items, int count, ProfileSink sink,
+        void *arg) {
+    if (count <= 0) {
+        return;
+    }
+
+    // per post: a formatted header, the shared contents, and a separator
+    char heads[count][2 * MAX_NAME + DATE_MAX + 24];
+    struct iovec iov[3 * count];
+    for (int i = 0; i < count; i++) {
+        const Post *post = items[i].post;
+        char date[DATE_MAX];
+        format_date(post->date, date);
+        iov[3 * i].iov_base = heads[i];
+        iov[3 * i].iov_len = snprintf(heads[i], sizeof(heads[i]),
+            "From: %s\r\nTo: %s\r\nDate: %s\r\n", post->author,
+            items[i].target->name, date);
+        iov[3 * i + 1].iov_base = post->contents->text;
+        iov[3 * i + 1].iov_len = post->contents->len;
+        iov[3 * i + 2].iov_base = "\r\n" POST_BREAK;
+        iov[3 * i + 2].iov_len = i < count - 1 ? 2 + POST_BREAK_LEN : 2;
+    }
+    sink(arg, iov, 3 * count);
+}
+
+
+/*
+ * Create a post from the user named author and insert it at the front of
+ * target's posts, its profile cache and its posts index. The post takes a
+ * reference to contents. The caller must hold target->lock, which keeps
+ * the seq numbers of target's posts in the same order as the posts. The
+ * caller indexes the post for search once the lock is released.
+ */
+static Post *add_post(const char *author, User *target, Str *contents,
+        time_t date) {
+    Post *new_post = pool_alloc(&post_pool);
+    strncpy(new_post->author, author, MAX_NAME);
+    new_post->contents = str_ref(contents);
+    new_post->date = date;
+    new_post->seq = __atomic_add_fetch(&last_post_seq, 1, __ATOMIC_RELAXED);
+    new_post->next = target->first_post;
+    target->first_post = new_post;
+    render_profile_post(target, new_post);
+
+    // append to the posts index, oldest first
+    if (target->num_posts == target->posts_alloc) {
+        int new_alloc = target->posts_alloc == 0 ? 8 : target->posts_alloc * 2;
+        Post **posts = realloc(target->posts, new_alloc * sizeof(Post *));
+        if (posts == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        target->posts = posts;
+        target->posts_alloc = new_alloc;
+    }
+    target->posts[target->num_posts] = new_post;
+
+    // feeds read the count without locking target
+    __atomic_store_n(&target->num_posts, target->num_posts + 1,
+        __ATOMIC_RELEASE);
+    return new_post;
+}
+
+
 /*
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
@@ -239,47 +1389,116 @@ char *print_user(const User *user) {
  *
  * Use the 'time' function to store the current time.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * The post takes its own reference to 'contents', which comes from
+ * new_post_text; the caller still releases its reference when done.
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents) {
+int make_post(const User *author, User *target, Str *contents) {
     if (target == NULL || author == NULL) {
         return 2;
     }
 
-    int friends = 0;
-    for (int i = 0; i < MAX_FRIENDS && target->friends[i] != NULL; i++) {
-        if (strcmp(target->friends[i]->name, author->name) == 0) {
-            friends = 1;
-            break;
-        }
-    }
+    pthread_rwlock_rdlock(&mutation_lock);
+    pthread_mutex_lock(&target->lock);
 
-    if (friends == 0) {
+    if (!has_friend(target, author)) {
+        pthread_mutex_unlock(&target->lock);
+        pthread_rwlock_unlock(&mutation_lock);
         return 1;
     }
 
-    // Create post
-    Post *new_post = malloc(sizeof(Post));
-    if (new_post == NULL) {
-        perror("malloc");
-        exit(1);
+    Post *new_post = add_post(author->name, target, contents, time(NULL));
+    if (hooks.post_made != NULL) {
+        hooks.post_made(author, target, new_post);
     }
-    strncpy(new_post->author, author->name, MAX_NAME);
-    new_post->contents = contents;
-    new_post->date = malloc(sizeof(time_t));
-    if (new_post->date == NULL) {
-        perror("malloc");
-        exit(1);
-    }
-    time(new_post->date);
-    new_post->next = target->first_post;
-    target->first_post = new_post;
 
+    pthread_mutex_unlock(&target->lock);
+    pthread_rwlock_unlock(&mutation_lock);
+
+    FeedItem item = {new_post, target};
+    search_add(&item, 1);
     return 0;
 }
+
+
+/*
+ * Post contents from author to every one of author's friends. Every post
+ * takes a reference to the same immutable contents instead of a copy.
+ * Store a dynamically allocated array of the friends posted to in
+ * *targets, or NULL if there are none.
+ *
+ * Return the number of friends posted to, or -1 if author is NULL.
+ */
+int broadcast_post(const User *author, Str *contents, User ***targets) {
+    *targets = NULL;
+    if (author == NULL) {
+        return -1;
+    }
+
+    // the whole broadcast is one mutation, so a snapshot sees all or none
+    pthread_rwlock_rdlock(&mutation_lock);
+    pthread_mutex_lock((pthread_mutex_t *)&author->lock);
+    int count = author->num_friends;
+    User **friends = NULL;
+    if (count > 0) {
+        friends = malloc(count * sizeof(User *));
+        if (friends == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        memcpy(friends, author->friends, count * sizeof(User *));
+    }
+    pthread_mutex_unlock((pthread_mutex_t *)&author->lock);
+    FeedItem *items = NULL;
+    if (count > 0) {
+        items = malloc(count * sizeof(FeedItem));
+        if (items == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+
+    // friendships are never undone, so every one of them still holds; each
+    // post is dated under its target's lock, like make_post, so a profile's
+    // posts stay in date order for the feed merge
+    for (int i = 0; i < count; i++) {
+        User *target = friends[i];
+        pthread_mutex_lock(&target->lock);
+        Post *new_post = add_post(author->name, target, contents, time(NULL));
+        if (hooks.post_made != NULL) {
+            hooks.post_made(author, target, new_post);
+        }
+        pthread_mutex_unlock(&target->lock);
+        items[i] = (FeedItem){new_post, target};
+    }
+    pthread_rwlock_unlock(&mutation_lock);
+
+    // the posts share their contents, so its terms are found only once
+    if (count > 0) {
+        search_add(items, count);
+    }
+    free(items);
+
+    *targets = friends;
+    return count;
+}
+
+
+/*
+ * Add a post from author to target with the given date and the len bytes of
+ * contents, without checking that they are friends or running hooks. Used
+ * to rebuild saved state.
+ */
+void restore_post(const char *author, User *target, const char *contents,
+        int len, time_t date) {
+    Str *copy = str_from(&text_arena, contents, len);
+    pthread_mutex_lock(&target->lock);
+    FeedItem item = {add_post(author, target, copy, date), target};
+    pthread_mutex_unlock(&target->lock);
+    search_add(&item, 1);
+    str_release(&text_arena, copy);
+}
@@ -1,24 +1,92 @@
 #include <time.h>
 #include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "alloc.h"
 
-#define MAX_NAME 32     // Max username and profile_pic filename lengths
-#define MAX_FRIENDS 10  // Max number of friends a user can have
+#define MAX_NAME 32        // Max username and profile_pic filename lengths
+#define MAX_FRIENDS 10000  // Max number of friends a user can have
+#define SUGGEST_MAX 100    // Max friend suggestions kept per user
+#define FEED_MAX 100       // Max posts kept in a user's feed
 
 typedef struct user {
     char name[MAX_NAME];
     char profile_pic[MAX_NAME];  // This is a *filename*, not the file contents.
     struct post *first_post;
-    struct user *friends[MAX_FRIENDS];
     struct user *next;
+    unsigned int id;             // compact number, unique among all users
+    pthread_mutex_t lock;        // guards friends, posts and the profile cache
+
+    // Friends in the order they were made, and their ids sorted for lookup.
+    struct user **friends;
+    unsigned int *friend_ids;
+    int num_friends;
+    int friends_alloc;           // capacity of friends and friend_ids
+
+    // Pre-rendered profile, kept up to date by make_friends and make_post.
+    char *profile_head;          // name and friends, through "Posts:"
+    int head_len;
+    int head_cap;                // size of profile_head
+    char *posts_buf;             // rendered posts, newest first, at the end
+    int posts_cap;               // size of posts_buf
+    int posts_start;             // offset of the first rendered byte
+
+    struct post **posts;         // index of every post, oldest first
+    int num_posts;
+    int posts_alloc;             // capacity of posts
+
+    // Cached friend suggestions, best first, rebuilt when make_friends has
+    // bumped suggest_version since they were ranked at suggest_built.
+    struct suggestion *suggestions;
+    int num_suggestions;
+    unsigned int suggest_version;    // updated atomically
+    unsigned int suggest_built;
+
+    // Cached feed: the newest posts on the profiles of this user and its
+    // friends, newest first, merged from the first feed_seen[i] posts of
+    // source i. Source 0 is the user itself and source i its friends[i - 1].
+    struct feed_item *feed;
+    int feed_len;
+    int *feed_seen;
+    int feed_sources;            // number of entries in feed_seen
 } User;
 
+typedef struct suggestion {
+    const User *user;
+    int mutual;      // number of friends in common
+} Suggestion;
+
 typedef struct post {
     char author[MAX_NAME];
-    char *contents;
-    time_t *date;
+    Str *contents;   // shared and immutable, in the post string arena
+    time_t date;
     struct post *next;
+    int tail_off;    // bytes from this post's rendering to the end of posts_buf
+    unsigned long seq;   // creation order, from 1; also its search index id
 } Post;
 
+/*
+ * A post, with the user whose profile it is on.
+ */
+typedef struct feed_item {
+    const Post *post;
+    const User *target;
+} FeedItem;
+
+/*
+ * Thread safety: every function below may be called concurrently. The user
+ * directory is guarded by a reader/writer lock and each User by its own
+ * mutex, so operations on different users run in parallel. Users are never
+ * freed, so a User pointer stays valid after the call that returned it.
+ */
+
+
+/*
+ * Return the FNV-1a hash of a NUL-terminated name.
+ */
+unsigned int hash_name(const char *name);
+
+
 /*
  * Create a new user with the given name.  Insert it at the tail of the list
  * of users whose head is pointed to by *user_ptr_add.
@@ -35,6 +103,8 @@ int create_user(const char *name, User **user_ptr_add);
 /*
  * Return a pointer to the user with this name in
  * the list starting with head. Return NULL if no such user exists.
+ * Lookups in the list most recently passed to create_user use a hash
+ * index and take O(1) time.
  *
  * NOTE: You'll likely need to cast a (const User *) to a (User *)
  * to satisfy the prototype without warnings.
@@ -43,8 +113,10 @@ User *find_user(const char *name, const User *head);
 
 
 /*
- * Print the usernames of all users in the list starting at curr.
- * Names should be printed to standard output, one per line.
+ * Return a dynamically allocated string holding the usernames of all users
+ * in the list starting at curr, one per line. For the list most recently
+ * passed to create_user this is a copy of a directory kept up to date as
+ * users are created.
  */
 char *list_users(const User *curr);
 
@@ -54,7 +126,7 @@ char *list_users(const User *curr);
  * Make two users friends with each other.  This is symmetric - a pointer to
  * each user must be stored in the 'friends' array of the other.
  *
- * New friends must be added in the first empty spot in the 'friends' array.
+ * New friends are appended to the 'friends' array, which grows as needed.
  *
  * Return:
  *   - 0 on success.
@@ -70,12 +142,80 @@ char *list_users(const User *curr);
 int make_friends(const char *name1, const char *name2, User *head);
 
 
+/*
+ * Return 1 if user1 and user2 are friends, 0 otherwise, in O(log n) time
+ * for n friends of user1.
+ */
+int are_friends(const User *user1, const User *user2);
+
+
+/*
+ * Store in out up to k of the users who are not friends with user but share
+ * at least one friend with it, most mutual friends first and, among equals,
+ * oldest user first. k is capped at SUGGEST_MAX. The ranking is cached and
+ * only redone after make_friends changes a count it depends on.
+ * Return the number of suggestions stored.
+ */
+int suggest_friends(User *user, int k, Suggestion *out);
+
+
 /* 
  * Return a pointer to a dynamically allocated string holding a user profile.
  */
 char *print_user(const User *user);
 
 
+/*
+ * Receives a rendered profile or list of users as iovcnt pieces of memory.
+ */
+typedef void (*ProfileSink)(void *arg, const struct iovec *iov, int iovcnt);
+
+/*
+ * Pass the cached profile of user to sink as an iovec array, without
+ * copying it. The user is locked while sink runs, so sink must not block
+ * or call back into this module.
+ */
+void send_user(const User *user, ProfileSink sink, void *arg);
+
+
+/*
+ * Like send_user, but include at most limit posts, skipping the offset
+ * newest ones. A negative limit includes every post after offset.
+ */
+void send_user_page(const User *user, int offset, int limit,
+        ProfileSink sink, void *arg);
+
+
+/*
+ * Pass the newest n posts on the profiles of user and all of its friends,
+ * newest first, to sink as an iovec array; the contents are not copied.
+ * n is capped at FEED_MAX. The feed is cached and refreshed by merging in
+ * only the posts made since, so sink runs with no user locked.
+ * Return the number of posts passed.
+ */
+int send_feed(User *user, int n, ProfileSink sink, void *arg);
+
+
+/*
+ * Pass the count posts in items to sink as an iovec array, in order, each
+ * with its author, target and date; the contents are not copied.
+ */
+void send_posts(const FeedItem *items, int count, ProfileSink sink,
+        void *arg);
+
+
+/*
+ * Pass the names of at most limit users of the list starting at head,
+ * skipping the first cursor, to sink, one per line. A negative limit
+ * includes every user after cursor. For the list most recently passed to
+ * create_user the names are a slice of the cached directory and are not
+ * copied; the directory is locked while sink runs, so sink must not block
+ * or call back into this module. Return the number of users in the list.
+ */
+int send_users(const User *head, int cursor, int limit, ProfileSink sink,
+        void *arg);
+
+
 /*
  * Make a new post from 'author' to the 'target' user,
  * containing the given contents, IF the users are friends.
@@ -84,14 +224,103 @@ char *print_user(const User *user);
  *
  * Use the 'time' function to store the current time.
  *
- * 'contents' is a pointer to heap-allocated memory - you do not need
- * to allocate more memory to store the contents of the post.
+ * The post takes its own reference to 'contents', which comes from
+ * new_post_text; the caller still releases its reference when done.
  *
  * Return:
  *   - 0 on success
  *   - 1 if users exist but are not friends
  *   - 2 if either User pointer is NULL
  */
-int make_post(const User *author, User *target, char *contents);
+int make_post(const User *author, User *target, Str *contents);
+
+
+/*
+ * Post contents from author to every one of author's friends, as make_post
+ * would to each, with every post referencing the same contents. Store a
+ * dynamically allocated array of the friends posted to in *targets, or NULL
+ * if there are none; the caller frees it.
+ *
+ * Return the number of friends posted to, or -1 if author is NULL.
+ */
+int broadcast_post(const User *author, Str *contents, User ***targets);
+
+
+/*
+ * Return a new post body with room for len bytes of text, holding one
+ * reference for the caller, who fills it in before passing it on.
+ */
+Str *new_post_text(int len);
+
+/*
+ * Drop the caller's reference to a post body from new_post_text. A body
+ * that no post took, such as one rejected by make_post, is given back.
+ */
+void release_post_text(Str *text);
+
+
+/*
+ * Add the memory held by users, posts and post contents to stats.
+ */
+void memory_usage(MemStats *stats);
+
+/*
+ * Store the number of users and posts in *users and *posts.
+ */
+void object_counts(long *users, long *posts);
+
+
+/*
+ * Callbacks run after each successful mutation, while the users involved
+ * are still locked, so that observers see mutations of one user in order.
+ * They must not call back into this module.
+ */
+typedef struct friends_hooks {
+    void (*user_created)(const User *user);
+    void (*friends_made)(const User *user1, const User *user2);
+    void (*post_made)(const User *author, const User *target,
+            const Post *post);
+} FriendsHooks;
+
+/*
+ * Install the callbacks run after every successful create_user,
+ * make_friends and make_post. Any of them may be NULL.
+ */
+void set_friends_hooks(const FriendsHooks *hooks);
+
+
+/*
+ * Block every mutation until thaw_users is called, so that the whole user
+ * list can be read consistently.
+ */
+void freeze_users(void);
+
+/*
+ * Let mutations blocked by freeze_users proceed.
+ */
+void thaw_users(void);
+
+
+/*
+ * Append friend to user's friends array, one way only, without running
+ * hooks or re-rendering the profile. Used to rebuild saved state; call
+ * refresh_profile once the user's friends are all restored.
+ * Return 0 on success, 1 if user already has MAX_FRIENDS friends or is
+ * already friends with friend.
+ */
+int restore_friend(User *user, User *friend);
+
+/*
+ * Re-render the cached profile header of user from its friends array.
+ */
+void refresh_profile(User *user);
+
+/*
+ * Add a post from author to target with the given date and the len bytes of
+ * contents, without checking that they are friends or running hooks. Used
+ * to rebuild saved state.
+ */
+void restore_post(const char *author, User *target, const char *contents,
+        int len, time_t date);
 
 
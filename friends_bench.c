@@ -0,0 +1,307 @@
+/*
+ * Microbenchmarks for the friends.c API
+ *
+ * Populates a user list in memory, then times each core operation over many
+ * calls and reports ns/op, heap allocations/op, and bytes/op newly reserved
+ * by the user and post pools and the post string arena. No sockets are
+ * involved, so changes to the data structures or allocators can be measured
+ * without network noise.
+ *
+ * Heap allocations are counted by linking with --wrap=malloc, --wrap=calloc
+ * and --wrap=realloc (see the Makefile), which routes every call made by
+ * friends.o, alloc.o and search.o through the wrappers below.
+ */
+
+#define _GNU_SOURCE
+
+#include "friends.h"
+#include "search.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+static long heap_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    __atomic_add_fetch(&heap_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+
+/*
+ * Counters at the start of a timed run.
+ */
+typedef struct mark {
+    struct timespec start;
+    long allocs;
+    size_t reserved;
+} Mark;
+
+static int num_users = 10000;
+static int num_posts = 100000;
+static int friends_per_user = 4;
+static int reads = 100000;
+static int list_reads = 100;
+static int post_bytes = 64;
+
+#define NUM_TEXTS 256       // distinct post bodies, cycled through
+#define VOCABULARY 1000     // distinct words in post bodies
+
+static User *user_list = NULL;
+static User **users;
+
+
+/*
+ * Store the name of user i in name, which holds MAX_NAME bytes.
+ */
+static void user_name(int i, char *name) {
+    snprintf(name, MAX_NAME, "user%d", i);
+}
+
+
+/*
+ * Start timing a run.
+ */
+static void begin(Mark *mark) {
+    MemStats stats = {0, 0, 0};
+    memory_usage(&stats);
+    mark->reserved = stats.reserved;
+    mark->allocs = heap_allocs;
+    clock_gettime(CLOCK_MONOTONIC, &mark->start);
+}
+
+
+/*
+ * Finish a run of ops operations started at mark and print its line.
+ */
+static void end(const Mark *mark, const char *op, long ops) {
+    struct timespec stop;
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    double ns = (stop.tv_sec - mark->start.tv_sec) * 1e9
+        + (stop.tv_nsec - mark->start.tv_nsec);
+    MemStats stats = {0, 0, 0};
+    memory_usage(&stats);
+    printf("%-16s %10ld %12.1f %12.3f %12.1f\n", op, ops, ns / ops,
+        (double)(heap_allocs - mark->allocs) / ops,
+        (double)(stats.reserved - mark->reserved) / ops);
+}
+
+
+/*
+ * Fill the len bytes of text with random words "w0" to "w<VOCABULARY - 1>",
+ * so that posts can be searched.
+ */
+static void random_words(char *text, int len, unsigned int *seed) {
+    int pos = 0;
+    while (pos < len) {
+        char word[16];
+        int n = snprintf(word, sizeof(word), "w%d ", rand_r(seed) % VOCABULARY);
+        memcpy(text + pos, word, n < len - pos ? n : len - pos);
+        pos += n;
+    }
+}
+
+
+/*
+ * A ProfileSink that only touches the pieces, like a send without the socket.
+ */
+static void count_sink(void *arg, const struct iovec *iov, int iovcnt) {
+    size_t *total = arg;
+    for (int i = 0; i < iovcnt; i++) {
+        *total += iov[i].iov_len;
+    }
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-u users] [-p posts] [-f friends_per_user]"
+        " [-r reads] [-b post_bytes]\n", prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "u:p:f:r:b:")) != -1) {
+        switch (opt) {
+            case 'u': num_users = atoi(optarg); break;
+            case 'p': num_posts = atoi(optarg); break;
+            case 'f': friends_per_user = atoi(optarg); break;
+            case 'r': reads = atoi(optarg); break;
+            case 'b': post_bytes = atoi(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (num_users < 2 || num_posts < 0 || friends_per_user < 1
+            || friends_per_user >= num_users || reads < 1 || post_bytes < 1) {
+        usage(argv[0]);
+    }
+    list_reads = reads / 1000 > 0 ? reads / 1000 : 1;
+
+    Mark mark;
+    char name[MAX_NAME], other[MAX_NAME];
+    unsigned int seed = 1;
+
+    users = malloc(num_users * sizeof(User *));
+    char *contents = malloc(NUM_TEXTS * post_bytes);
+    if (users == NULL || contents == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int i = 0; i < NUM_TEXTS; i++) {
+        random_words(contents + i * post_bytes, post_bytes, &seed);
+    }
+
+    printf("%d users, %d friends each way, %d posts of %d bytes\n",
+        num_users, friends_per_user, num_posts, post_bytes);
+    printf("%-16s %10s %12s %12s %12s\n", "operation", "ops", "ns/op",
+        "allocs/op", "bytes/op");
+
+    begin(&mark);
+    for (int i = 0; i < num_users; i++) {
+        user_name(i, name);
+        if (create_user(name, &user_list) != 0) {
+            fprintf(stderr, "create_user %s failed\n", name);
+            exit(1);
+        }
+    }
+    end(&mark, "create_user", num_users);
+
+    begin(&mark);
+    for (int i = 0; i < num_users; i++) {
+        user_name(i, name);
+        users[i] = find_user(name, user_list);
+    }
+    end(&mark, "find_user", num_users);
+
+    // user i befriends the next friends_per_user users, wrapping around
+    long made = 0, failed = 0;
+    begin(&mark);
+    for (int i = 0; i < num_users; i++) {
+        user_name(i, name);
+        for (int k = 1; k <= friends_per_user; k++) {
+            user_name((i + k) % num_users, other);
+            if (make_friends(name, other, user_list) == 0) {
+                made++;
+            } else {
+                failed++;
+            }
+        }
+    }
+    end(&mark, "make_friends", made + failed);
+    if (failed > 0) {
+        printf("  (%ld make_friends calls failed)\n", failed);
+    }
+
+    // each post goes from a random user to one of the users it befriended
+    begin(&mark);
+    failed = 0;
+    for (int i = 0; i < num_posts; i++) {
+        int author = rand_r(&seed) % num_users;
+        int target = (author + 1 + rand_r(&seed) % friends_per_user)
+            % num_users;
+        Str *text = new_post_text(post_bytes);
+        memcpy(text->text, contents + i % NUM_TEXTS * post_bytes, post_bytes);
+        if (make_post(users[author], users[target], text) != 0) {
+            failed++;
+        }
+        release_post_text(text);
+    }
+    end(&mark, "make_post", num_posts);
+    if (failed > 0) {
+        printf("  (%ld make_post calls failed)\n", failed);
+    }
+
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        user_name(rand_r(&seed) % num_users, name);
+        if (find_user(name, user_list) == NULL) {
+            fprintf(stderr, "find_user %s failed\n", name);
+            exit(1);
+        }
+    }
+    end(&mark, "find_user (rand)", reads);
+
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        user_name(num_users + rand_r(&seed) % num_users, name);
+        find_user(name, user_list);
+    }
+    end(&mark, "find_user (miss)", reads);
+
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        free(print_user(users[rand_r(&seed) % num_users]));
+    }
+    end(&mark, "print_user", reads);
+
+    size_t sent = 0;
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        send_user(users[rand_r(&seed) % num_users], count_sink, &sent);
+    }
+    end(&mark, "send_user", reads);
+
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        send_user_page(users[rand_r(&seed) % num_users], 0, 10, count_sink,
+            &sent);
+    }
+    end(&mark, "send_user_page", reads);
+
+    begin(&mark);
+    for (int i = 0; i < list_reads; i++) {
+        free(list_users(user_list));
+    }
+    end(&mark, "list_users", list_reads);
+
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        send_users(user_list, rand_r(&seed) % num_users, 100, count_sink,
+            &sent);
+    }
+    end(&mark, "send_users page", reads);
+
+    FeedItem found[SEARCH_MAX];
+    long matches = 0;
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        char word[16];
+        snprintf(word, sizeof(word), "w%d", rand_r(&seed) % VOCABULARY);
+        const char *words[] = {word};
+        matches += search_posts(words, 1, 10, found);
+    }
+    end(&mark, "search (1 term)", reads);
+
+    begin(&mark);
+    for (int i = 0; i < reads; i++) {
+        char word1[16], word2[16];
+        snprintf(word1, sizeof(word1), "w%d", rand_r(&seed) % VOCABULARY);
+        snprintf(word2, sizeof(word2), "w%d", rand_r(&seed) % VOCABULARY);
+        const char *words[] = {word1, word2};
+        matches += search_posts(words, 2, 10, found);
+    }
+    end(&mark, "search (2 terms)", reads);
+
+    MemStats stats = {0, 0, 0};
+    memory_usage(&stats);
+    printf("memory: %zu bytes reserved, %zu used, %zu allocations\n",
+        stats.reserved, stats.used, stats.allocs);
+    return 0;
+}
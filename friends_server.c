@@ -1,352 +1,1401 @@
-/*
- * FriendMe (Network Version)
- *   
- * Taken/Modified from Alan J Rosenthal's server, muffinman.c:
- *      - methods add_client, remove_client, new_connection
- *      - linked list of clients (added name member)
- *
- * Shray Sharma, Saman Motamed, April 2016
- */
-
-#include <stdio.h>
-#include <ctype.h>
-#include <string.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <time.h>
-#include <errno.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <sys/signal.h>
-
-#include "friends.h"
-#include "friends_server.h"
-
-#define INPUT_BUFFER_SIZE 256
-#define INPUT_ARG_MAX_NUM 12
-#define DELIM " \n"
-
-#ifndef PORT
-  #define PORT 50472
-#endif
-
-
-// create the head of the empty client linked list
-Client *top = NULL;
-int num_clients = 0;
-
-char prompt[] = 
-    "\r\nWelcome to FriendMe!"
-    "\r\n------------------------------"
-    "\r\nPlease enter your username: ";
-
-    
-/*
- * Setup socket and return the file descriptor for listening.
- */
-int setup() {
-    int on = 1, status;
-    struct sockaddr_in self;
-  
-    int listenfd;
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        exit(1);
-    }
-
-    // Make sure we can reuse the port immediately after the server terminates.
-    status = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
-                      (const char *) &on, sizeof(on));
-    if(status == -1) {
-        perror("setsockopt -- REUSEADDR");
-    }
-
-    self.sin_family = AF_INET;
-    self.sin_addr.s_addr = INADDR_ANY;
-    self.sin_port = htons(PORT);
-    memset(&self.sin_zero, 0, sizeof(self.sin_zero)); // Initialize sin_zero to 0
-
-    if (bind(listenfd, (struct sockaddr *)&self, sizeof(self)) == -1) {
-        perror("bind"); // probably means port is in use
-        exit(1);
-    }
-
-    printf("Server started: Listening on port %d\n", PORT);
-    
-    if (listen(listenfd, 5) == -1) {
-        perror("listen");
-        exit(1);
-    }
-  
-    return listenfd;
-}
-
-
-int main() {
-    // Create the head of the empty user linked list
-    User *user_list = NULL;
-    
-    Client *client;
-    int listenfd = setup(); // setup socket and get listenfd
-    
-    while (1) {
-        
-        // initialize fd set, add listen fd
-        fd_set fdlist;
-        int maxfd = listenfd;
-        FD_ZERO(&fdlist);
-        FD_SET(listenfd, &fdlist);
-        
-        // add fd's of all clients to set, find max fd
-        client = top;
-        while (client) {
-            FD_SET(client->fd, &fdlist);
-            if (client->fd > maxfd)
-                maxfd = client->fd;
-            client = client->next;
-        }
-        
-        if (select(maxfd + 1, &fdlist, NULL, NULL, NULL) == -1) {
-            perror("select");
-            exit(1);
-        }
-        
-        // check fds of clients, read if set
-        client = top;
-        while (client) {
-            if (FD_ISSET(client->fd, &fdlist)) {
-                client = get_args(client, &user_list);
-            } else {
-                client = client->next;
-            }
-        }
-            
-        // if listenfd is set, accept new connection
-        if (FD_ISSET(listenfd, &fdlist))
-            new_connection(listenfd);
-    }
-    
-    return 0;
-}
-
-
-/*
- * Search the first inbuf characters of buf for a network newline ("\r\n").
- * Return the location of the '\r' if the network newline is found,
- * or -1 otherwise.
- */
-int find_network_newline(const char *buf, int inbuf) {
-    for (int i = 0; i < inbuf; i++) {
-        if (buf[i] == '\r') {
-            if (buf[i + 1] == '\n') {
-                return i;   // return the location of '\r' if found
-            }
-        }
-        else if (buf[i] == '\n') {
-            return i;
-        }
-    }
-
-    return -1;  // network newline not found
-}
-
-
-/*
- * Accept the new connection, create a new client, and ask for a username.
- */
-void new_connection(int listenfd) {
-    int fd;
-    struct sockaddr_in peer;
-    socklen_t socklen = sizeof(peer);
-
-    if ((fd = accept(listenfd, (struct sockaddr *)&peer, &socklen)) < 0) {
-        perror("accept");
-        exit(1);
-    } else {
-        printf("Accepting connection from %s\n", inet_ntoa(peer.sin_addr));
-        Client *client = add_client(fd, peer.sin_addr);
-        write(client->fd, prompt, sizeof(prompt) - 1);
-    }
-}
-
-
-/*
- * Create a new client and insert it at the head of the client's list.
- */
-Client *add_client(int fd, struct in_addr addr) {
-    Client *new_client = malloc(sizeof(Client));
-    if (!new_client) {
-        perror("malloc");
-        exit(1);
-    }
-    
-    printf("Connection established with %s\n", inet_ntoa(addr));
-    fflush(stdout);
-    
-    // initialize name as empty
-    for (int i = 0; i < MAX_NAME; i++) {
-        new_client->name[i] = '\0';
-    }
-    
-    // initialize buffer as empty
-    for (int i = 0; i < INPUT_BUFFER_SIZE; i++) {
-        new_client->buf[i] = '\0';
-    }
-    
-    new_client->fd = fd;
-    new_client->inbuf = 0;
-    new_client->room = 0;
-    new_client->after = new_client->buf;
-    new_client->where = 0;
-    new_client->ipaddr = addr;
-    new_client->next = top;
-    top = new_client;
-    num_clients++;
-    
-    return new_client;
-}
-
-
-/*
- * Remove client associated with the given file descriptor from linked list, 
- * free all allocated memory, and close the file descriptor.
- */
-void remove_client(int fd) {
-    Client **client;
-    
-    // find client with given fd
-    for (client = &top; *client && (*client)->fd != fd;
-        client = &(*client)->next);
-
-    // if fd was found, remove client from list, free memory, and close fd
-    if (*client) {
-        Client *temp = (*client)->next;
-        if ((close(fd)) == -1) {
-            perror("close");
-        }
-        free(*client);
-        *client = temp;
-        num_clients--;
-    } else {
-        fprintf(stderr, "Error: client with fd %d not found\n", fd);
-        fflush(stderr);
-    }
-}
-
-
-/*
- * Read and process input from client's fd. Return the next client in list.
- */
-Client *get_args(Client *client, User **user_list_ptr) {
-    int nbytes;
-    Client *next = client->next;
-    
-    nbytes = read(client->fd, client->after, client->room);
-    if (nbytes == -1) {
-        perror("read");
-        exit(1);
-    }
-
-    // update inbuf with nbytes, look for network newline
-    client->inbuf += nbytes;
-    client->where = find_network_newline(client->buf, client->inbuf);
-        
-    if (client->where >= 0) {   // detected a new line 
-            
-        // null terminate the line
-        client->buf[client->where] = '\0';
-        client->buf[client->where + 1] = '\0';
-        
-        // if client is already logged in, process commands
-        if (client->name[0] != '\0') {
-            printf("Message received from %s: %s\r\n", client->name,
-                client->buf);
-            fflush(stdout);
-            
-            // tokenize input into arguments
-            char *cmd_argv[INPUT_ARG_MAX_NUM];
-            int cmd_argc = tokenize(client->buf, cmd_argv);
-
-            // process commands
-            if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, user_list_ptr,
-                    client, &top) == -1) {
-                char buf[80];
-                printf("Client %s disconnected\n", inet_ntoa(client->ipaddr));
-                fflush(stdout);
-                sprintf(buf, "Logging you out, %s...\r\n", client->name);
-                write(client->fd, buf, strlen(buf));
-                remove_client(client->fd);
-                return next; // can only reach if quit command was entered
-            } else if (cmd_argc == 0) {
-                error("your message was too long.", client->fd);
-            }
-                
-            write(client->fd, "\r\n> ", 4);
-
-        } else { // new client, create new user or log into existing one
-            char temp_name[MAX_NAME];
-            if (strlen(client->buf) >= MAX_NAME) {
-                strncpy(temp_name, client->buf, MAX_NAME - 1);
-                temp_name[MAX_NAME] = '\0';
-            } else {
-                strcpy(temp_name, client->buf);
-            }
-            switch (create_user(temp_name, user_list_ptr)) {
-                case 0: // new user successfully created
-                {
-                    strcpy(client->name, temp_name);
-                    int len = 43 + strlen(client->name);
-                    char out[len];
-                    snprintf(out, len,
-                    "\r\nGreetings, %s!\r\nPlease type a command:\r\n> ",
-                    client->name);
-                    write(client->fd, out, len);
-                }
-                    break;
-                case 1: // user exists, client is a returning user
-                {
-                    strcpy(client->name, temp_name);
-                    int len = 46 + strlen(client->name);
-                    char out[len];
-                    snprintf(out, len,
-                    "\r\nWelcome back, %s!\r\nPlease type a command:\r\n> ",
-                    client->name);
-                    write(client->fd, out, len);
-                }
-                    break;
-                case 2: // given name is too long
-                    error("username is too long", client->fd);
-                    write(client->fd, "\r\n> ", 4);
-                    break;
-            }
-        }
-          
-        // update inbuf and remove the full line from buf
-        client->inbuf -= (client->where + 2);
-        for (int i = 0; i < client->where; i++) {
-            client->buf[i] = '\0';
-        }
-          
-        // move content after the full line to beginning of buf
-        memmove(&client->buf[0], &client->buf[client->where +2], client->inbuf);
-    }
-    // update room and after, in preparation for the next read
-    client->room  = sizeof(client->buf) - client->inbuf;
-    client->after = &client->buf[client->inbuf];
-    
-    return next;
-}
-
-
-/* 
- * Write a formatted error message to fd.
- */
-void error(char *msg, int fd) {
-    int len = 10 + strlen(msg);
-    char out[len];
-    snprintf(out, len, "Error: %s\r\n", msg);
-    write(fd, out, len);
-}
+/*
+ * FriendMe (Network Version)
+ *   
+ * Taken/Modified from Alan J Rosenthal's server, muffinman.c:
+ *      - methods add_client, remove_client, new_connection
+ *      - linked list of clients (added name member)
+ *
+ * Shray Sharma, Saman Motamed, April 2016
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/signal.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "friends.h"
+#include "friends_server.h"
+#include "store.h"
+#include "stats.h"
+#include "log.h"
+#include "limit.h"
+
+#define MAX_EVENTS 64           // max ready events handled per epoll_wait
+#define LINE_MAX_DEFAULT 4096   // default longest command line, in bytes
+#define INPUT_MIN_CAP 256       // initial size of a client's input buffer
+#define OUT_HIGH_WATER 65536    // default output high-water mark in bytes
+#define OUT_MIN_CAP 1024        // initial size of a client's output ring
+#define CORK_COPY_MAX 2048      // longest reply queued rather than written corked
+#define NOTIFY_LIMIT 4          // drop a peer queued past this * high water
+#define LISTEN_BACKLOG 128      // default length of each accept queue
+#define LOGIN_TIMEOUT 60        // default seconds allowed to log in
+
+#ifndef PORT
+  #define PORT 50472
+#endif
+
+
+// number of connected clients across all workers, updated atomically
+int num_clients = 0;
+
+// head of the user list shared by every worker
+User *user_list = NULL;
+
+// stop reading from a client while more than this many bytes are queued to it
+int out_high_water = OUT_HIGH_WATER;
+
+// longest line accepted from a client, not counting its network newline
+int max_line = LINE_MAX_DEFAULT;
+
+// connections the kernel queues on each listening socket before accept
+int listen_backlog = LISTEN_BACKLOG;
+
+// most clients connected at once across all workers, or 0 for no limit
+int max_clients = 0;
+
+// drop a logged-in client after this many seconds without a command, or 0
+int idle_timeout = 0;
+
+// drop a client that has not logged in after this many seconds, or 0
+int login_timeout = LOGIN_TIMEOUT;
+
+// log one in this many commands received, at debug level (-s)
+int log_sample = 1;
+
+// commands received by this thread, for sampling
+static __thread unsigned int messages_seen = 0;
+
+// the worker whose event loop runs on this thread
+static __thread Worker *current_worker = NULL;
+
+char prompt[] = 
+    "\r\nWelcome to FriendMe!"
+    "\r\n------------------------------"
+    "\r\nPlease enter your username: ";
+
+    
+/*
+ * Setup socket and return the file descriptor for listening.
+ */
+int setup() {
+    int on = 1, status;
+    struct sockaddr_in self;
+  
+    int listenfd;
+    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        exit(1);
+    }
+
+    // Make sure we can reuse the port immediately after the server terminates.
+    status = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                      (const char *) &on, sizeof(on));
+    if(status == -1) {
+        perror("setsockopt -- REUSEADDR");
+    }
+
+    // Let every worker bind its own socket; the kernel spreads connections.
+    status = setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                      (const char *) &on, sizeof(on));
+    if(status == -1) {
+        perror("setsockopt -- REUSEPORT");
+    }
+
+    self.sin_family = AF_INET;
+    self.sin_addr.s_addr = INADDR_ANY;
+    self.sin_port = htons(PORT);
+    memset(&self.sin_zero, 0, sizeof(self.sin_zero)); // Initialize sin_zero to 0
+
+    if (bind(listenfd, (struct sockaddr *)&self, sizeof(self)) == -1) {
+        perror("bind"); // probably means port is in use
+        exit(1);
+    }
+
+    if (listen(listenfd, listen_backlog) == -1) {
+        perror("listen");
+        exit(1);
+    }
+
+    // the listening socket is edge-triggered, so accept() must never block
+    if (fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        exit(1);
+    }
+  
+    return listenfd;
+}
+
+
+/*
+ * Handle the epoll events reported for client: flush queued output when the
+ * socket is writable and read new input when it is readable.
+ */
+static void handle_event(Client *client, uint32_t events) {
+    if ((events & (EPOLLERR | EPOLLHUP))
+            || __atomic_load_n(&client->dead, __ATOMIC_ACQUIRE)) {
+        remove_client(client);
+        return;
+    }
+    
+    int resume = 0;
+    if (events & EPOLLOUT) {
+        int queued = flush_client(client);
+        if (queued == -1) {
+            remove_client(client);
+            return;
+        }
+        
+        // input was left unread while the queue was full; pick it up again
+        if (client->paused && queued <= out_high_water / 2) {
+            client->paused = 0;
+            resume = 1;
+        }
+    }
+    
+    if ((events & (EPOLLIN | EPOLLRDHUP)) || resume) {
+        get_args(client, &user_list);
+    }
+}
+
+
+/*
+ * Return the current monotonic time in whole seconds.
+ */
+static long now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+
+/*
+ * Return the second at which client times out if it stays silent, or 0 if
+ * it never does.
+ */
+static long client_deadline(Client *client) {
+    int timeout = client->logged_in ? idle_timeout : login_timeout;
+    return timeout > 0 ? client->active + timeout : 0;
+}
+
+
+/*
+ * File client in its owner's timer wheel under deadline.
+ */
+static void wheel_insert(Client *client, long deadline) {
+    Worker *worker = client->owner;
+    int slot = deadline & (WHEEL_SLOTS - 1);
+    client->wheel_slot = slot;
+    client->wheel_prev = NULL;
+    client->wheel_next = worker->wheel[slot];
+    if (client->wheel_next != NULL) {
+        client->wheel_next->wheel_prev = client;
+    }
+    worker->wheel[slot] = client;
+}
+
+
+/*
+ * Take client out of its owner's timer wheel, if it is in it.
+ */
+static void wheel_remove(Client *client) {
+    if (client->wheel_slot == -1) {
+        return;
+    }
+    if (client->wheel_prev != NULL) {
+        client->wheel_prev->wheel_next = client->wheel_next;
+    } else {
+        client->owner->wheel[client->wheel_slot] = client->wheel_next;
+    }
+    if (client->wheel_next != NULL) {
+        client->wheel_next->wheel_prev = client->wheel_prev;
+    }
+    client->wheel_slot = -1;
+}
+
+
+/*
+ * Put client in its owner's timer wheel if it can time out in its current
+ * state and is not there already. Called when it connects and logs in.
+ */
+static void schedule_timeout(Client *client) {
+    long deadline = client_deadline(client);
+    if (client->wheel_slot == -1 && deadline != 0) {
+        wheel_insert(client, deadline);
+    }
+}
+
+
+/*
+ * Tell client why it is being dropped for timing out, and remove it.
+ */
+static void reap_client(Client *client) {
+    int logged_in = client->logged_in;
+    if (log_level >= LOG_INFO) {
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client->ipaddr, addr, sizeof(addr));
+        log_msg(LOG_INFO, "Client %s timed out %s", addr,
+            logged_in ? "idle" : "before logging in");
+    }
+    error(logged_in ? "idle for too long, disconnecting."
+        : "took too long to log in, disconnecting.", client);
+    stats_event(STAT_REAPED);
+    remove_client(client);
+}
+
+
+/*
+ * Drop every client of worker whose idle or login timeout has passed.
+ * Called by the worker itself at the end of each pass through its event
+ * loop, once no event of the pass can refer to a client it drops. Each
+ * second's slot is emptied when that second arrives: clients that are due
+ * are reaped, and the rest go back in under their current deadline.
+ */
+void expire_clients(Worker *worker) {
+    long now = worker->now;
+    
+    // after a long stall every slot is due, but visiting each once is enough
+    if (now - worker->wheel_time > WHEEL_SLOTS) {
+        worker->wheel_time = now - WHEEL_SLOTS;
+    }
+    
+    while (worker->wheel_time < now) {
+        worker->wheel_time++;
+        int slot = worker->wheel_time & (WHEEL_SLOTS - 1);
+        Client *client = worker->wheel[slot];
+        worker->wheel[slot] = NULL;
+        while (client != NULL) {
+            Client *next = client->wheel_next;
+            client->wheel_slot = -1;
+            long deadline = client_deadline(client);
+            if (deadline != 0 && deadline <= now) {
+                reap_client(client);
+            } else if (deadline != 0) {
+                wheel_insert(client, deadline);
+            }
+            client = next;
+        }
+    }
+}
+
+
+/*
+ * Run the event loop of one worker: accept connections on its listening
+ * socket and serve the clients it owns. Never returns.
+ */
+void *run_worker(void *arg) {
+    Worker *worker = arg;
+    current_worker = worker;
+    
+    if ((worker->epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    
+    // register listenfd; a NULL data pointer marks it apart from clients
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->listenfd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    
+    // and the wakeup eventfd, marked by the worker itself
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = worker;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, worker->wakefd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    
+    struct epoll_event events[MAX_EVENTS];
+    worker->now = worker->wheel_time = now_seconds();
+    while (1) {
+        // wake at least once a second while anything may time out or retry
+        int timeout = -1;
+        if (idle_timeout > 0 || login_timeout > 0 || worker->accept_retry) {
+            timeout = 1000;
+        }
+        int nready = epoll_wait(worker->epfd, events, MAX_EVENTS, timeout);
+        if (nready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(1);
+        }
+        
+        worker->now = now_seconds();
+        
+        // only the sockets that are actually ready are visited
+        for (int i = 0; i < nready; i++) {
+            Client *client = events[i].data.ptr;
+            if (client == NULL) {
+                new_connection(worker);
+            } else if (events[i].data.ptr == worker) {
+                uint64_t count;
+                if (read(worker->wakefd, &count, sizeof(count)) == -1
+                        && errno != EAGAIN) {
+                    perror("read");
+                }
+            } else {
+                handle_event(client, events[i].events);
+            }
+        }
+        
+        // send the notifications queued during this pass, one writev each
+        flush_pending(worker);
+        
+        // only now, with no events left that could name a reaped client
+        expire_clients(worker);
+        if (worker->accept_retry) {
+            worker->accept_retry = 0;
+            new_connection(worker);
+        }
+    }
+    
+    return NULL;
+}
+
+
+/*
+ * Usage: friends_server [-t threads] [-w high_water] [-l max_line]
+ *                       [-d data_dir] [-L level] [-v] [-s sample]
+ *                       [-b backlog] [-m max_clients] [-r ip_rate]
+ *                       [-R user_rate] [-i idle_timeout] [-a login_timeout]
+ *
+ * -t sets the number of worker event loops; 0 means one per online core.
+ * -w sets the per-client output high-water mark in bytes.
+ * -l sets the longest command line accepted, in bytes.
+ * -d keeps users, friendships and posts in data_dir across restarts.
+ * -L logs at level and above: error, warn, info (the default) or debug.
+ * -v logs every command received; short for -L debug.
+ * -s logs only one in sample commands received, when they are logged.
+ * -b sets how many connections each listening socket queues for accept.
+ * -m turns away connections beyond max_clients; 0 (the default) admits all.
+ * -r and -R limit each IP address and each user to so many commands per
+ *    second, in bursts of up to that many; 0 (the default) is no limit.
+ * -i drops logged-in clients silent for idle_timeout seconds; 0 (the
+ *    default) never does.
+ * -a drops clients that have not logged in within login_timeout seconds
+ *    (default 60); 0 never does.
+ */
+int main(int argc, char **argv) {
+    int num_workers = 1;
+    char *data_dir = NULL;
+    int ip_rate = 0, user_rate = 0;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:l:d:L:vs:b:m:r:R:i:a:")) != -1) {
+        switch (opt) {
+            case 't':
+                num_workers = atoi(optarg);
+                break;
+            case 'w':
+                out_high_water = atoi(optarg);
+                break;
+            case 'l':
+                max_line = atoi(optarg);
+                break;
+            case 'd':
+                data_dir = optarg;
+                break;
+            case 'L':
+                if ((log_level = log_parse_level(optarg)) == -1) {
+                    fprintf(stderr, "%s: unknown log level %s\n", argv[0],
+                        optarg);
+                    exit(1);
+                }
+                break;
+            case 'v':
+                log_level = LOG_DEBUG;
+                break;
+            case 's':
+                log_sample = atoi(optarg);
+                break;
+            case 'b':
+                listen_backlog = atoi(optarg);
+                break;
+            case 'm':
+                max_clients = atoi(optarg);
+                break;
+            case 'r':
+                ip_rate = atoi(optarg);
+                break;
+            case 'R':
+                user_rate = atoi(optarg);
+                break;
+            case 'i':
+                idle_timeout = atoi(optarg);
+                break;
+            case 'a':
+                login_timeout = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-t threads] [-w high_water] "
+                    "[-l max_line] [-d data_dir] [-L level] [-v] "
+                    "[-s sample] [-b backlog] [-m max_clients] "
+                    "[-r ip_rate] [-R user_rate] [-i idle_timeout] "
+                    "[-a login_timeout]\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (log_sample <= 0) {
+        log_sample = 1;
+    }
+    log_start();
+    init_commands();
+    if (out_high_water <= 0) {
+        out_high_water = OUT_HIGH_WATER;
+    }
+    if (max_line <= 0) {
+        max_line = LINE_MAX_DEFAULT;
+    }
+    if (listen_backlog <= 0) {
+        listen_backlog = LISTEN_BACKLOG;
+    }
+    limit_init(ip_rate, user_rate);
+    
+    // a peer that disconnects mid-write must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (data_dir != NULL) {
+        store_open(data_dir, &user_list);
+    }
+    if (num_workers <= 0) {
+        num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_workers <= 0) {
+        num_workers = 1;
+    }
+    
+    Worker *workers = calloc(num_workers, sizeof(Worker));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    
+    // bind every listening socket up front so startup errors are reported
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].listenfd = setup();
+        workers[i].top = NULL;
+        workers[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if (workers[i].wakefd == -1) {
+            perror("eventfd");
+            exit(1);
+        }
+        pthread_mutex_init(&workers[i].pending_lock, NULL);
+        workers[i].pending = NULL;
+        workers[i].spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        workers[i].accept_retry = 0;
+    }
+    log_msg(LOG_INFO, "Server started: Listening on port %d with %d worker%s",
+        PORT, num_workers, num_workers == 1 ? "" : "s");
+    
+    // the main thread runs worker 0 itself
+    for (int i = 1; i < num_workers; i++) {
+        int err = pthread_create(&workers[i].thread, NULL, run_worker,
+            &workers[i]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    run_worker(&workers[0]);
+    
+    return 0;
+}
+
+
+/*
+ * Search the first inbuf characters of buf for a newline. Lines may end in
+ * a network newline ("\r\n") or a bare '\n'; the caller strips the '\r'.
+ * Return the location of the '\n' if found, or -1 otherwise. memchr scans
+ * a word or vector register at a time rather than byte by byte.
+ */
+int find_network_newline(const char *buf, int inbuf) {
+    const char *newline = memchr(buf, '\n', inbuf);
+    return newline != NULL ? newline - buf : -1;
+}
+
+
+/*
+ * Tell the peer on fd, a connection just accepted, that the server is full,
+ * and close it.
+ */
+static void reject_connection(int fd, struct in_addr addr) {
+    static const char full[] = "Error: server is full, try again later\r\n";
+    
+    // a fresh socket always has room for this; if not, it is not missed
+    if (write(fd, full, sizeof(full) - 1) == -1) {
+        log_msg(LOG_DEBUG, "write: %s", strerror(errno));
+    }
+    close(fd);
+    stats_event(STAT_CONNS_REJECTED);
+    
+    if (log_level >= LOG_WARN) {
+        char addr_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+        log_msg(LOG_WARN, "Rejected connection from %s: %d clients",
+            addr_str, max_clients);
+    }
+}
+
+
+/*
+ * Deal with accept failing on worker's listening socket with err, for any
+ * reason but there being no connection left to accept.
+ * Return 1 if accepting can go on, 0 if it must wait for the next tick.
+ */
+static int accept_failed(Worker *worker, int err) {
+    switch (err) {
+        case EINTR:
+        case ECONNABORTED:
+        // errors of the new connection rather than the socket; see accept(2)
+        case EPROTO:
+        case ENOPROTOOPT:
+        case ENETDOWN:
+        case ENETUNREACH:
+        case ENONET:
+        case EHOSTDOWN:
+        case EHOSTUNREACH:
+        case EOPNOTSUPP:
+            return 1;
+    }
+    
+    stats_event(STAT_ACCEPT_ERRORS);
+    if ((err == EMFILE || err == ENFILE) && worker->spare_fd != -1) {
+        // out of descriptors: free the spare for long enough to shed one
+        // connection, rather than leave the backlog to fill up
+        close(worker->spare_fd);
+        int fd = accept(worker->listenfd, NULL, NULL);
+        if (fd != -1) {
+            close(fd);
+        }
+        worker->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (fd != -1) {
+            stats_event(STAT_CONNS_REJECTED);
+            log_msg(LOG_WARN, "accept: %s; dropped a connection",
+                strerror(err));
+            return 1;
+        }
+    }
+    
+    log_msg(LOG_WARN, "accept: %s; retrying", strerror(err));
+    worker->accept_retry = 1;
+    return 0;
+}
+
+
+/*
+ * Accept the new connections on worker's listening socket, create a new
+ * client for each, and ask for a username. Connections beyond the client
+ * limit are told the server is full and closed.
+ */
+void new_connection(Worker *worker) {
+    int fd;
+    struct sockaddr_in peer;
+    socklen_t socklen = sizeof(peer);
+    
+    if (worker->spare_fd == -1) {
+        worker->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    // edge-triggered: drain every pending connection before returning
+    while (1) {
+        socklen = sizeof(peer);
+        if ((fd = accept4(worker->listenfd, (struct sockaddr *)&peer,
+                &socklen, SOCK_NONBLOCK)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else if (accept_failed(worker, errno)) {
+                continue;
+            }
+            return;
+        }
+        
+        // claim a place before adding, so workers together respect the cap
+        if (__atomic_add_fetch(&num_clients, 1, __ATOMIC_RELAXED) > max_clients
+                && max_clients > 0) {
+            __atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+            reject_connection(fd, peer.sin_addr);
+            continue;
+        }
+        
+        // replies are batched before they are written; don't delay them again
+        int on = 1;
+        if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) == -1) {
+            log_msg(LOG_DEBUG, "setsockopt -- NODELAY: %s", strerror(errno));
+        }
+        
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, addr, sizeof(addr));
+        log_msg(LOG_INFO, "Accepting connection from %s", addr);
+        Client *client = add_client(worker, fd, peer.sin_addr);
+        client_send(client, prompt, sizeof(prompt) - 1);
+    }
+}
+
+
+/*
+ * Create a new client owned by worker and insert it at the head of the
+ * worker's client list. The caller has already counted it in num_clients.
+ */
+Client *add_client(Worker *worker, int fd, struct in_addr addr) {
+    Client *new_client = malloc(sizeof(Client));
+    if (!new_client) {
+        perror("malloc");
+        exit(1);
+    }
+    
+    if (log_level >= LOG_INFO) {
+        char addr_str[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &addr, addr_str, sizeof(addr_str));
+        log_msg(LOG_INFO, "Connection established with %s", addr_str);
+    }
+    
+    // initialize name as empty
+    for (int i = 0; i < MAX_NAME; i++) {
+        new_client->name[i] = '\0';
+    }
+    new_client->logged_in = 0;
+    
+    // the input buffer is allocated on the first read
+    new_client->buf = NULL;
+    new_client->buf_cap = 0;
+    new_client->start = 0;
+    new_client->inbuf = 0;
+    new_client->scan = 0;
+    new_client->discard = 0;
+    
+    new_client->fd = fd;
+    new_client->ipaddr = addr;
+    new_client->out = NULL;
+    new_client->out_cap = 0;
+    new_client->out_head = 0;
+    new_client->out_len = 0;
+    new_client->paused = 0;
+    new_client->corked = 0;
+    new_client->dead = 0;
+    pthread_mutex_init(&new_client->out_lock, NULL);
+    new_client->owner = worker;
+    new_client->flush_queued = 0;
+    new_client->pending_next = NULL;
+    new_client->active = worker->now;
+    new_client->wheel_slot = -1;
+    new_client->prev = NULL;
+    new_client->session_next = NULL;
+    new_client->next = worker->top;
+    if (worker->top != NULL) {
+        worker->top->prev = new_client;
+    }
+    worker->top = new_client;
+    schedule_timeout(new_client);
+    
+    // register with epoll; the event carries the client itself
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = new_client;
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    
+    return new_client;
+}
+
+
+/*
+ * Remove client from the linked list and the epoll set, free all allocated
+ * memory, and close its file descriptor.
+ */
+void remove_client(Client *client) {
+    Worker *worker = client->owner;
+    
+    // stop other workers from queueing to it, then send what we still can
+    if (client->logged_in) {
+        remove_session(client);
+    }
+    flush_client(client);
+    
+    // nothing can queue to it any more; take it off the pending list (not
+    // finding it there means flush_pending has already taken the list)
+    pthread_mutex_lock(&worker->pending_lock);
+    if (client->flush_queued) {
+        Client **curr = &worker->pending;
+        while (*curr != NULL && *curr != client) {
+            curr = &(*curr)->pending_next;
+        }
+        if (*curr != NULL) {
+            *curr = client->pending_next;
+        }
+    }
+    pthread_mutex_unlock(&worker->pending_lock);
+    wheel_remove(client);
+    
+    if (epoll_ctl(worker->epfd, EPOLL_CTL_DEL, client->fd, NULL) == -1) {
+        perror("epoll_ctl");
+    }
+    if ((close(client->fd)) == -1) {
+        perror("close");
+    }
+    
+    // unlink in O(1) using the back pointer
+    if (client->prev != NULL) {
+        client->prev->next = client->next;
+    } else {
+        worker->top = client->next;
+    }
+    if (client->next != NULL) {
+        client->next->prev = client->prev;
+    }
+    
+    pthread_mutex_destroy(&client->out_lock);
+    free(client->out);
+    free(client->buf);
+    free(client);
+    __atomic_sub_fetch(&num_clients, 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Log that client has disconnected.
+ */
+static void log_disconnect(Client *client) {
+    if (log_level >= LOG_INFO) {
+        char addr[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client->ipaddr, addr, sizeof(addr));
+        log_msg(LOG_INFO, "Client %s disconnected", addr);
+    }
+}
+
+
+/*
+ * Process one complete, NUL-terminated line of len bytes from client. The
+ * line lives in client's input buffer and is tokenized in place.
+ * Return -1 if the client quit and was removed, 0 otherwise.
+ */
+static int process_line(Client *client, char *line, int len,
+        User **user_list_ptr) {
+    // refuse the line unread if its address or user is over its rate
+    if (!limit_command(client->ipaddr, client->name)) {
+        stats_event(STAT_RATE_LIMITED);
+        error("too many commands, please slow down.", client);
+        client_send(client, "\r\n> ", 4);
+        return 0;
+    }
+    
+    // if client is already logged in, process commands
+    if (client->logged_in) {
+        client->active = client->owner->now;
+        if (log_level >= LOG_DEBUG && messages_seen++ % log_sample == 0) {
+            log_msg(LOG_DEBUG, "Message received from %s: %s", client->name,
+                line);
+        }
+        
+        // tokenize input into arguments
+        Token cmd_argv[INPUT_ARG_MAX_NUM];
+        int cmd_argc = tokenize(line, len, cmd_argv, INPUT_ARG_MAX_NUM);
+
+        // process commands
+        if (cmd_argc > 0 && process_args(cmd_argc, cmd_argv, user_list_ptr,
+                client) == -1) {
+            char buf[80];
+            log_disconnect(client);
+            sprintf(buf, "Logging you out, %s...\r\n", client->name);
+            client_send(client, buf, strlen(buf));
+            remove_client(client);
+            return -1; // can only reach if quit command was entered
+        } else if (cmd_argc == -1) {
+            error("Too many arguments!", client);
+        }
+            
+        client_send(client, "\r\n> ", 4);
+
+    } else { // new client, create new user or log into existing one
+        char temp_name[MAX_NAME];
+        if (strlen(line) >= MAX_NAME) {
+            strncpy(temp_name, line, MAX_NAME - 1);
+            temp_name[MAX_NAME - 1] = '\0';
+        } else {
+            strcpy(temp_name, line);
+        }
+        
+        // a blank name could never be addressed by another user's command
+        if (temp_name[strspn(temp_name, " \t")] == '\0') {
+            error("username must not be empty", client);
+            client_send(client, "\r\n> ", 4);
+            return 0;
+        }
+        
+        switch (create_user(temp_name, user_list_ptr)) {
+            case 0: // new user successfully created
+            {
+                strcpy(client->name, temp_name);
+                client->logged_in = 1;
+                add_session(client);
+                client->active = client->owner->now;
+                schedule_timeout(client);
+                int len = 43 + strlen(client->name);
+                char out[len];
+                len = snprintf(out, len,
+                "\r\nGreetings, %s!\r\nPlease type a command:\r\n> ",
+                client->name);
+                client_send(client, out, len);
+            }
+                break;
+            case 1: // user exists, client is a returning user
+            {
+                strcpy(client->name, temp_name);
+                client->logged_in = 1;
+                add_session(client);
+                client->active = client->owner->now;
+                schedule_timeout(client);
+                int len = 46 + strlen(client->name);
+                char out[len];
+                len = snprintf(out, len,
+                "\r\nWelcome back, %s!\r\nPlease type a command:\r\n> ",
+                client->name);
+                client_send(client, out, len);
+            }
+                break;
+            case 2: // given name is too long
+                error("username is too long", client);
+                client_send(client, "\r\n> ", 4);
+                break;
+        }
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Make room at the end of client's full input buffer for the next read,
+ * by moving the partial line at its end to the front, or by growing it up
+ * to max_line plus a network newline.
+ * Return -1 if the partial line already fills the largest buffer allowed.
+ */
+static int make_room(Client *client) {
+    if (client->start > 0) {
+        client->inbuf -= client->start;
+        client->scan -= client->start;
+        memmove(client->buf, client->buf + client->start, client->inbuf);
+        client->start = 0;
+        return 0;
+    }
+    
+    int max_cap = max_line + 2;
+    if (client->buf_cap >= max_cap) {
+        return -1;
+    }
+    int new_cap = client->buf_cap == 0 ? INPUT_MIN_CAP : client->buf_cap * 2;
+    if (new_cap > max_cap) {
+        new_cap = max_cap;
+    }
+    char *buf = realloc(client->buf, new_cap);
+    if (buf == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    client->buf = buf;
+    client->buf_cap = new_cap;
+    return 0;
+}
+
+
+/*
+ * Set whether client's replies are queued rather than written right away.
+ */
+static void set_corked(Client *client, int corked) {
+    pthread_mutex_lock(&client->out_lock);
+    client->corked = corked;
+    pthread_mutex_unlock(&client->out_lock);
+}
+
+
+/*
+ * Write out the replies client has queued while corked.
+ * Return -1 if the client was removed, 0 otherwise.
+ */
+static int flush_replies(Client *client) {
+    if (flush_client(client) == -1) {
+        remove_client(client);
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ * Read and process all input available on client's fd. The socket is
+ * edge-triggered, so keep reading until the kernel has nothing left and
+ * handle every complete line that arrived. The caller has corked client;
+ * the replies to each read's lines are flushed together after the last.
+ * If the replies back up past the high-water mark, stop after the line
+ * that did it and leave the rest buffered until the peer catches up.
+ * Return -1 if the client was removed, 0 otherwise.
+ */
+static int read_commands(Client *client, User **user_list_ptr) {
+    while (1) {
+        // a failed send (possibly from another worker) marked it for removal
+        if (__atomic_load_n(&client->dead, __ATOMIC_ACQUIRE)) {
+            remove_client(client);
+            return -1;
+        }
+        
+        // backpressure: leave input unhandled until the peer drains its replies.
+        // Notifications are queued without a write, so try one first: only
+        // a socket that refused bytes will report EPOLLOUT to resume on.
+        if (queued_bytes(client) > out_high_water) {
+            if (flush_replies(client) == -1) {
+                return -1;
+            }
+            if (queued_bytes(client) > out_high_water) {
+                client->paused = 1;
+                return 0;
+            }
+        }
+        
+        // handle every complete line buffered; each byte is scanned only once
+        int where;
+        while (client->scan < client->inbuf
+                && (where = find_network_newline(client->buf + client->scan,
+                    client->inbuf - client->scan)) >= 0) {
+            char *line = client->buf + client->start;
+            int len = client->scan + where - client->start;
+            client->start = client->scan = client->scan + where + 1;
+            
+            if (client->discard) {  // the tail of a line that was too long
+                client->discard = 0;
+                continue;
+            }
+            
+            // null terminate the line in place, dropping the '\r'
+            if (len > 0 && line[len - 1] == '\r') {
+                len--;
+            }
+            line[len] = '\0';
+            
+            if (process_line(client, line, len, user_list_ptr) == -1) {
+                return -1;
+            }
+            
+            // one long reply is enough to fill the queue; check each command
+            if (queued_bytes(client) > out_high_water) {
+                if (flush_replies(client) == -1) {
+                    return -1;
+                }
+                if (queued_bytes(client) > out_high_water) {
+                    client->paused = 1;
+                    return 0;
+                }
+            }
+        }
+        
+        // one writev for every reply to this read, before the next is taken
+        if (flush_replies(client) == -1) {
+            return -1;
+        }
+        
+        // everything consumed: reuse the buffer from the start, no copying
+        if (client->start == client->inbuf) {
+            client->start = client->inbuf = client->scan = 0;
+        }
+        
+        if (client->inbuf == client->buf_cap && make_room(client) == -1) {
+            // a full buffer with no newline can never become a valid line
+            if (!client->discard) {
+                error("your message was too long.", client);
+                client_send(client, "\r\n> ", 4);
+                client->discard = 1;
+            }
+            client->start = client->inbuf = client->scan = 0;
+        }
+        
+        int nbytes = recv(client->fd, client->buf + client->inbuf,
+            client->buf_cap - client->inbuf, MSG_DONTWAIT);
+        if (nbytes == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;   // drained; wait for the next edge
+            } else if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            remove_client(client);
+            return -1;
+        } else if (nbytes == 0) {  // peer closed the connection
+            log_disconnect(client);
+            remove_client(client);
+            return -1;
+        }
+
+        stats_bytes_in(nbytes);
+        client->inbuf += nbytes;
+    }
+}
+
+
+/*
+ * Read and process all input available on client's fd. Replies are corked
+ * while the commands run, so the replies to all the commands that arrive
+ * in one read, prompts included, go out in a single writev rather than in
+ * two or more writes per command.
+ * Return -1 if the client was removed, 0 otherwise.
+ */
+int get_args(Client *client, User **user_list_ptr) {
+    set_corked(client, 1);
+    if (read_commands(client, user_list_ptr) == -1) {
+        return -1;
+    }
+    set_corked(client, 0);
+    return flush_replies(client);
+}
+
+
+/*
+ * Return the number of bytes waiting in client's output queue.
+ */
+int queued_bytes(Client *client) {
+    pthread_mutex_lock(&client->out_lock);
+    int len = client->out_len;
+    pthread_mutex_unlock(&client->out_lock);
+    return len;
+}
+
+
+/*
+ * Fill iov with client's queued output, which wraps around the end of the
+ * ring at most once. The caller must hold client->out_lock. Return the
+ * number of pieces used: 0, 1 or 2.
+ */
+static int queue_iov(Client *client, struct iovec *iov) {
+    if (client->out_len == 0) {
+        return 0;
+    }
+    int first = client->out_cap - client->out_head;
+    if (first > client->out_len) {
+        first = client->out_len;
+    }
+    iov[0].iov_base = client->out + client->out_head;
+    iov[0].iov_len = first;
+    if (first == client->out_len) {
+        return 1;
+    }
+    iov[1].iov_base = client->out;
+    iov[1].iov_len = client->out_len - first;
+    return 2;
+}
+
+
+/*
+ * Drop the first n bytes of client's output queue, which the socket took.
+ * The caller must hold client->out_lock.
+ */
+static void consume_locked(Client *client, int n) {
+    client->out_head = (client->out_head + n) & (client->out_cap - 1);
+    client->out_len -= n;
+    if (client->out_len == 0) {
+        client->out_head = 0;
+    }
+}
+
+
+/*
+ * Write as much of client's output queue as the socket accepts. The caller
+ * must hold client->out_lock. Return 0 on success, -1 on a socket error.
+ */
+static int flush_locked(Client *client) {
+    while (client->out_len > 0) {
+        struct iovec iov[2];
+        ssize_t n = writev(client->fd, iov, queue_iov(client, iov));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;   // EPOLLOUT tells the owner when to resume
+            }
+            return -1;
+        }
+        stats_bytes_out(n);
+        consume_locked(client, n);
+    }
+    return 0;
+}
+
+
+/*
+ * Flush client's output queue without blocking.
+ * Return the number of bytes still queued, or -1 on a socket error.
+ */
+int flush_client(Client *client) {
+    pthread_mutex_lock(&client->out_lock);
+    int result = flush_locked(client);
+    if (result == 0) {
+        result = client->out_len;
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    return result;
+}
+
+
+/*
+ * Append len bytes of buf to client's output ring, growing it as needed so
+ * output is never truncated. The caller must hold client->out_lock.
+ */
+static void enqueue_locked(Client *client, const char *buf, int len) {
+    if (client->out_len + len > client->out_cap) {
+        int new_cap = client->out_cap == 0 ? OUT_MIN_CAP : client->out_cap;
+        while (new_cap < client->out_len + len) {
+            new_cap *= 2;
+        }
+        
+        // unwrap the queued bytes to the start of the new ring
+        char *out = malloc(new_cap);
+        if (out == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        int first = client->out_cap - client->out_head;
+        if (first > client->out_len) {
+            first = client->out_len;
+        }
+        memcpy(out, client->out + client->out_head, first);
+        memcpy(out + first, client->out, client->out_len - first);
+        free(client->out);
+        client->out = out;
+        client->out_cap = new_cap;
+        client->out_head = 0;
+    }
+    
+    int tail = (client->out_head + client->out_len) & (client->out_cap - 1);
+    int first = client->out_cap - tail;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(client->out + tail, buf, first);
+    memcpy(client->out, buf + first, len - first);
+    client->out_len += len;
+}
+
+
+/*
+ * Send the iovcnt pieces of iov to client without blocking. They go to the
+ * socket in one writev behind anything already queued, and only what it
+ * does not take is copied into the output queue. While client is corked a
+ * reply of up to CORK_COPY_MAX bytes is queued instead, to be written by
+ * get_args with the other replies to the same read; a longer one is worth
+ * its own write rather than a copy. Safe to call from any worker thread.
+ */
+void client_sendv(Client *client, const struct iovec *iov, int iovcnt) {
+    pthread_mutex_lock(&client->out_lock);
+    if (client->dead) {
+        pthread_mutex_unlock(&client->out_lock);
+        return;
+    }
+    
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    
+    // corked: a short reply waits in the queue to go out with the rest
+    if (client->corked && len <= CORK_COPY_MAX) {
+        for (int i = 0; i < iovcnt; i++) {
+            enqueue_locked(client, iov[i].iov_base, iov[i].iov_len);
+        }
+        pthread_mutex_unlock(&client->out_lock);
+        return;
+    }
+    
+    // write the queue and the reply in one writev, straight from where they lie
+    struct iovec all[iovcnt + 2];
+    int queued = queue_iov(client, all);
+    memcpy(all + queued, iov, iovcnt * sizeof(struct iovec));
+    ssize_t sent;
+    do {
+        sent = writev(client->fd, all, queued + iovcnt);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            __atomic_store_n(&client->dead, 1, __ATOMIC_RELEASE);
+            pthread_mutex_unlock(&client->out_lock);
+            return;
+        }
+        sent = 0;
+    }
+    stats_bytes_out(sent);
+    
+    // queued bytes go first, so the socket took those before any of iov
+    if (sent >= client->out_len) {
+        sent -= client->out_len;
+        consume_locked(client, client->out_len);
+    } else {
+        consume_locked(client, sent);
+        sent = 0;
+    }
+    
+    // queue whatever the socket did not take
+    for (int i = 0; i < iovcnt; i++) {
+        if ((size_t)sent >= iov[i].iov_len) {
+            sent -= iov[i].iov_len;
+        } else {
+            enqueue_locked(client, (char *)iov[i].iov_base + sent,
+                iov[i].iov_len - sent);
+            sent = 0;
+        }
+    }
+    if (!client->corked && flush_locked(client) == -1) {
+        __atomic_store_n(&client->dead, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&client->out_lock);
+}
+
+
+/*
+ * Send len bytes of buf to client without blocking. Whatever the socket
+ * does not take right away is queued and flushed when it becomes writable.
+ * Safe to call from any worker thread.
+ */
+void client_send(Client *client, const char *buf, int len) {
+    struct iovec iov;
+    iov.iov_base = (char *)buf;
+    iov.iov_len = len;
+    client_sendv(client, &iov, 1);
+}
+
+
+/*
+ * Put client on its owner's pending list, so that the owner flushes it at
+ * the end of its event loop pass, and wake the owner if it is another
+ * worker that may be sleeping in epoll_wait.
+ */
+static void schedule_flush(Client *client) {
+    Worker *owner = client->owner;
+    pthread_mutex_lock(&owner->pending_lock);
+    if (client->flush_queued) {
+        pthread_mutex_unlock(&owner->pending_lock);
+        return;
+    }
+    int was_empty = owner->pending == NULL;
+    client->flush_queued = 1;
+    client->pending_next = owner->pending;
+    owner->pending = client;
+    pthread_mutex_unlock(&owner->pending_lock);
+    
+    // one wakeup per batch is enough; the owner empties the whole list
+    if (was_empty && owner != current_worker) {
+        uint64_t one = 1;
+        if (write(owner->wakefd, &one, sizeof(one)) == -1) {
+            perror("write");
+        }
+    }
+}
+
+
+/*
+ * Queue the iovcnt pieces of iov to client as one unsolicited notification,
+ * to be flushed by its owner at the end of its event loop pass. A client
+ * that has let more than NOTIFY_LIMIT times the high-water mark pile up is
+ * not reading, so it is marked for removal instead of buffering forever.
+ */
+void client_notifyv(Client *client, const struct iovec *iov, int iovcnt) {
+    int len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    
+    pthread_mutex_lock(&client->out_lock);
+    if (client->dead) {
+        pthread_mutex_unlock(&client->out_lock);
+        return;
+    }
+    if (client->out_len + len > NOTIFY_LIMIT * out_high_water) {
+        // the shutdown wakes the owning worker, which removes the client
+        __atomic_store_n(&client->dead, 1, __ATOMIC_RELEASE);
+        shutdown(client->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&client->out_lock);
+        return;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        enqueue_locked(client, iov[i].iov_base, iov[i].iov_len);
+    }
+    pthread_mutex_unlock(&client->out_lock);
+    schedule_flush(client);
+}
+
+
+/*
+ * Queue len bytes of buf to client as an unsolicited notification; see
+ * client_notifyv.
+ */
+void client_notify(Client *client, const char *buf, int len) {
+    struct iovec iov;
+    iov.iov_base = (char *)buf;
+    iov.iov_len = len;
+    client_notifyv(client, &iov, 1);
+}
+
+
+/*
+ * Flush every client on worker's pending list, resuming the input of any
+ * that was paused and has drained. Called by the worker itself once per
+ * pass through its event loop.
+ */
+void flush_pending(Worker *worker) {
+    // take the whole list, so other workers can start a new one meanwhile
+    pthread_mutex_lock(&worker->pending_lock);
+    Client *client = worker->pending;
+    worker->pending = NULL;
+    pthread_mutex_unlock(&worker->pending_lock);
+    
+    // a client stays marked queued until just before its flush, so nobody
+    // can put it on the new list, and overwrite its link, while this one
+    // is still being walked
+    while (client != NULL) {
+        pthread_mutex_lock(&worker->pending_lock);
+        Client *next = client->pending_next;
+        client->flush_queued = 0;
+        pthread_mutex_unlock(&worker->pending_lock);
+        
+        int queued = flush_client(client);
+        if (queued == -1) {
+            remove_client(client);
+        } else if (client->paused && queued <= out_high_water / 2) {
+            // the flush may have drained the socket's backlog without an
+            // EPOLLOUT ever being reported, so resume the input here
+            client->paused = 0;
+            get_args(client, &user_list);
+        }
+        client = next;
+    }
+}
+
+
+/* 
+ * Write a formatted error message to client.
+ */
+void error(char *msg, Client *client) {
+    int len = 10 + strlen(msg);
+    char out[len];
+    len = snprintf(out, len, "Error: %s\r\n", msg);
+    client_send(client, out, len);
+}
@@ -1,78 +1,253 @@
-#include <time.h>
-#include <arpa/inet.h>
-
-#define MAX_NAME 32             // Max username length
-#define INPUT_BUFFER_SIZE 256   // Max buffer length
-
- /*************************Taken from muffinman.c****************************/
-
-typedef struct client {
-    char name[MAX_NAME];
-    char buf[INPUT_BUFFER_SIZE];
-    int inbuf;      // number of bytes currently in buffer
-    int room;       // number of bytes available in buffer
-    char *after;    // pointer to position after the (valid) data in buf
-    int where;      // location of network newline
-    int fd;
-    struct in_addr ipaddr;
-    struct client *next;
-} Client;
-
-/*
- * Create a new client and insert it at the head of the client's list.
- */
-Client *add_client(int fd, struct in_addr addr);
-
-/*
- * Remove client associated with the given file descriptor from linked list, 
- * free all allocated memory, and close the file descriptor.
- */
-void remove_client(int fd);
-
-/*
- * Accept the new connection, create a new client, and ask for a username.
- */
-void new_connection(int listenfd);
-
- /***************************************************************************/
-
-/*
- * Setup socket and return the file descriptor for listening.
- */
-int setup();
-
-/*
- * Read and process input from client's fd. Return the next client in list.
- */
-Client *get_args(Client *client, User **user_list_ptr);
-
-/*
- * Search the first inbuf characters of buf for a network newline ("\r\n").
- * Return the location of the '\r' if the network newline is found,
- * or -1 otherwise.
- */
-int find_network_newline(const char *buf, int inbuf);
-
-/*
- * Tokenize the string stored in cmd.
- * Return the number of tokens, and store the tokens in cmd_argv.
- */
-int tokenize(char *cmd, char **cmd_argv);
-
-/* 
- * Read and process commands
- * Return:  -1 for quit command
- *          0 otherwise
- */
-int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr, 
-        Client *client, Client **top);
-
-/*
- * Find a client with the given name. Return NULL if no such client exists.
- */
-Client *find_client(char *name, Client **top);
-
-/* 
- * Write a formatted error message to fd.
- */
-void error(char *msg, int fd);
+#include <time.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#define MAX_NAME 32             // Max username length
+#define INPUT_ARG_MAX_NUM 11    // Max tokens in a command line
+#define WHEEL_SLOTS 64          // one-second slots in a worker's timer wheel
+
+ /*************************Taken from muffinman.c****************************/
+
+struct worker;
+
+// number of connected clients across all workers, updated atomically
+extern int num_clients;
+
+typedef struct client {
+    char name[MAX_NAME];
+    int logged_in;  // name is set and the client is in the session index
+    char *buf;      // input buffer, grown up to max_line + 2 bytes
+    int buf_cap;    // size of buf
+    int start;      // offset of the first byte not yet consumed
+    int inbuf;      // offset just past the last byte read
+    int scan;       // offset of the first byte not yet searched for a newline
+    int discard;    // skipping the rest of a line that was too long
+    int fd;
+    struct in_addr ipaddr;
+    char *out;          // ring buffer of output not yet accepted by the socket
+    int out_cap;        // size of out, zero or a power of two
+    int out_head;       // index of the first queued byte in out
+    int out_len;        // number of bytes queued in out
+    pthread_mutex_t out_lock;   // guards out; other workers send notifications
+    int paused;         // input left unread until the output queue drains
+    int corked;         // replies are queued, not written; guarded by out_lock
+    int dead;           // a send failed; the owner must remove the client
+    struct worker *owner;   // worker whose event loop serves this client
+    int flush_queued;   // on owner's pending list; guarded by its pending_lock
+    struct client *pending_next;    // next client on owner's pending list
+    long active;        // second of the last command, or of connecting
+    int wheel_slot;     // slot of owner's timer wheel it is in, or -1
+    struct client *wheel_prev;
+    struct client *wheel_next;
+    struct client *prev;
+    struct client *next;
+    struct client *session_next;    // next client in the same session bucket
+} Client;
+
+/*
+ * One event loop thread. Each worker has its own listening socket (bound
+ * with SO_REUSEPORT), epoll instance and list of the clients it accepted.
+ *
+ * Notifications are queued rather than written on the spot. The clients
+ * they were queued to go on their owner's pending list, and the owner
+ * flushes each of them once at the end of its current pass through the
+ * event loop, so a burst of notifications costs one writev per client.
+ *
+ * Clients that may time out also sit in the worker's timer wheel, in the
+ * slot of the second at which they would. A command does not move its
+ * client; the slot is only checked when its second comes round, and any
+ * client found there that has been active since is filed under its new
+ * deadline instead of being dropped.
+ */
+typedef struct worker {
+    int id;
+    int listenfd;
+    int epfd;
+    int wakefd;     // eventfd that other workers use to wake this one
+    Client *top;    // head of this worker's client list
+    pthread_mutex_t pending_lock;   // guards pending
+    Client *pending;    // clients with notifications queued but not flushed
+    Client *wheel[WHEEL_SLOTS]; // clients by deadline, in seconds, modulo
+    long now;           // second at which the current loop pass started
+    long wheel_time;    // last second whose slot has been checked
+    int spare_fd;       // held open to be given up when out of descriptors
+    int accept_retry;   // accepting failed; try again on the next tick
+    pthread_t thread;
+} Worker;
+
+/*
+ * Create a new client owned by worker and insert it at the head of the
+ * worker's client list. The caller has already counted it in num_clients.
+ */
+Client *add_client(Worker *worker, int fd, struct in_addr addr);
+
+/*
+ * Remove client from the linked list and the epoll set, free all allocated
+ * memory, and close its file descriptor.
+ */
+void remove_client(Client *client);
+
+/*
+ * Accept the new connections on worker's listening socket, create a new
+ * client for each, and ask for a username. Connections beyond the client
+ * limit are told the server is full and closed.
+ */
+void new_connection(Worker *worker);
+
+ /***************************************************************************/
+
+/*
+ * Setup socket and return the file descriptor for listening.
+ */
+int setup();
+
+/*
+ * Drop every client of worker whose idle or login timeout has passed.
+ * Called by the worker itself at the end of each pass through its event
+ * loop, once no event of the pass can refer to a client it drops.
+ */
+void expire_clients(Worker *worker);
+
+/*
+ * Run the event loop of one worker: accept connections on its listening
+ * socket and serve the clients it owns. Never returns.
+ */
+void *run_worker(void *arg);
+
+/*
+ * Read and process all input available on client's fd. The replies to all
+ * the commands that arrive in one read go out in a single writev.
+ * Return -1 if the client was removed, 0 otherwise.
+ */
+int get_args(Client *client, User **user_list_ptr);
+
+/*
+ * Search the first inbuf characters of buf for a newline. Lines may end in
+ * a network newline ("\r\n") or a bare '\n'; the caller strips the '\r'.
+ * Return the location of the '\n' if found, or -1 otherwise.
+ */
+int find_network_newline(const char *buf, int inbuf);
+
+/*
+ * A token of a command line: text is NUL-terminated in place, within the
+ * line, and len is its length.
+ */
+typedef struct token {
+    char *text;
+    int len;
+} Token;
+
+/*
+ * Split the len bytes of cmd into tokens separated by runs of spaces, in
+ * place: each token is NUL-terminated where it lies in cmd and recorded in
+ * cmd_argv with its length, so nothing is copied or measured twice. Uses no
+ * state outside its arguments, so workers may tokenize concurrently.
+ * Return the number of tokens, or -1 if there are more than max_tokens.
+ */
+int tokenize(char *cmd, int len, Token *cmd_argv, int max_tokens);
+
+/*
+ * Build the command index. Must be called before the first process_args.
+ */
+void init_commands(void);
+
+/* 
+ * Read and process commands
+ * Return:  -1 for quit command
+ *          0 otherwise
+ */
+int process_args(int cmd_argc, Token *cmd_argv, User **user_list_ptr, 
+        Client *client);
+
+/*
+ * Add a client that has just logged in to the session index.
+ */
+void add_session(Client *client);
+
+/*
+ * Remove a logged-in client from the session index.
+ */
+void remove_session(Client *client);
+
+/*
+ * Queue len bytes of msg to every client logged in as name. Safe to call
+ * from any worker thread.
+ */
+void notify_user(const char *name, const char *msg, int len);
+
+/*
+ * Queue the iovcnt pieces of iov, as one message, to every client logged in
+ * as name. Safe to call from any worker thread.
+ */
+void notify_userv(const char *name, const struct iovec *iov, int iovcnt);
+
+/*
+ * Queue the iovcnt pieces of iov, as one message, to every client logged in
+ * as any of the count users, taking the session lock once. Safe to call
+ * from any worker thread.
+ */
+void notify_users(User **users, int count, const struct iovec *iov,
+        int iovcnt);
+
+/*
+ * Find a client with the given name. Return NULL if no such client exists.
+ * The caller must hold the session lock (see notify_user) while using it.
+ */
+Client *find_client(const char *name);
+
+/*
+ * Return the next client logged in with the same name as client, or NULL if
+ * client is the last one.
+ */
+Client *find_next_client(Client *client);
+
+/*
+ * Send the iovcnt pieces of iov to client without blocking, copying only
+ * what the socket does not take right away. While client is corked, short
+ * replies are queued for get_args to write in one go; a long one is written
+ * at once together with the queue. Safe to call from any worker thread.
+ */
+void client_sendv(Client *client, const struct iovec *iov, int iovcnt);
+
+/*
+ * Send len bytes of buf to client without blocking. Whatever the socket
+ * does not take right away is queued and flushed when it becomes writable.
+ * Safe to call from any worker thread.
+ */
+void client_send(Client *client, const char *buf, int len);
+
+/*
+ * Queue the iovcnt pieces of iov to client as one unsolicited notification,
+ * to be flushed by its owner at the end of its event loop pass. Drop the
+ * client if it has stopped reading.
+ */
+void client_notifyv(Client *client, const struct iovec *iov, int iovcnt);
+
+/*
+ * Queue len bytes of buf to client as an unsolicited notification; see
+ * client_notifyv.
+ */
+void client_notify(Client *client, const char *buf, int len);
+
+/*
+ * Flush every client on worker's pending list, resuming the input of any
+ * that was paused and has drained. Called by the worker itself once per
+ * pass through its event loop.
+ */
+void flush_pending(Worker *worker);
+
+/*
+ * Flush client's output queue without blocking.
+ * Return the number of bytes still queued, or -1 on a socket error.
+ */
+int flush_client(Client *client);
+
+/*
+ * Return the number of bytes waiting in client's output queue.
+ */
+int queued_bytes(Client *client);
+
+/* 
+ * Write a formatted error message to client.
+ */
+void error(char *msg, Client *client);
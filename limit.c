@@ -0,0 +1,167 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "limit.h"
+
+#define LIMIT_SLOT_BITS 16
+#define LIMIT_SLOTS (1 << LIMIT_SLOT_BITS)  // buckets per table
+#define LIMIT_STRIPES 64        // locks per table, a power of two
+
+/*
+ * One token bucket, kept as the time at which it will be full again
+ * (the "theoretical arrival time" of the generic cell rate algorithm): a
+ * command may run while that time is at most one second ahead of now, and
+ * each command pushes it on by the interval between tokens.
+ */
+typedef struct bucket {
+    long full_at;           // monotonic time in nanoseconds; 0 when unused
+} Bucket;
+
+typedef struct limiter {
+    long interval_ns;       // time to earn one token; 0 means no limit
+    long burst_ns;          // how far ahead full_at may run
+    Bucket slots[LIMIT_SLOTS];
+    pthread_mutex_t locks[LIMIT_STRIPES];   // slot i is guarded by i % STRIPES
+} Limiter;
+
+static Limiter ip_limiter;
+static Limiter user_limiter;
+static uint64_t slot_key[2];    // secret key of slot_hash, set by limit_init
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND(v0, v1, v2, v3) do { \
+        v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+        v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+    } while (0)
+
+
+/*
+ * Return the SipHash-2-4 of the len bytes of data under slot_key, reduced
+ * to a slot. Without the key, which slot a given address or name lands in
+ * cannot be predicted, so collisions cannot be aimed at another client.
+ */
+static unsigned int slot_hash(const void *data, size_t len) {
+    const unsigned char *in = data;
+    uint64_t v0 = slot_key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = slot_key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = slot_key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = slot_key[1] ^ 0x7465646279746573ULL;
+    
+    // whole 8-byte words, little-endian, then the tail tagged with len
+    uint64_t m;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        m = 0;
+        for (int j = 0; j < 8; j++) {
+            m |= (uint64_t)in[i + j] << (8 * j);
+        }
+        v3 ^= m;
+        SIPROUND(v0, v1, v2, v3);
+        SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    m = (uint64_t)len << 56;
+    for (int j = 0; i + j < len; j++) {
+        m |= (uint64_t)in[i + j] << (8 * j);
+    }
+    v3 ^= m;
+    SIPROUND(v0, v1, v2, v3);
+    SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    
+    v2 ^= 0xff;
+    for (int r = 0; r < 4; r++) {
+        SIPROUND(v0, v1, v2, v3);
+    }
+    return (unsigned int)((v0 ^ v1 ^ v2 ^ v3) & (LIMIT_SLOTS - 1));
+}
+
+
+/*
+ * Set up limiter to allow rate commands per second, or any number if rate
+ * is 0.
+ */
+static void limiter_init(Limiter *limiter, int rate) {
+    limiter->interval_ns = rate > 0 ? 1000000000L / rate : 0;
+    limiter->burst_ns = rate > 0 ? 1000000000L - limiter->interval_ns : 0;
+    for (int i = 0; i < LIMIT_STRIPES; i++) {
+        pthread_mutex_init(&limiter->locks[i], NULL);
+    }
+}
+
+
+/*
+ * Limit every IP address to ip_rate commands per second and every user to
+ * user_rate. A rate of 0 turns that limit off, and choose the secret key
+ * of the slot hash. Call before any worker starts.
+ */
+void limit_init(int ip_rate, int user_rate) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1) {
+        perror("open /dev/urandom");
+        exit(1);
+    }
+    if (read(fd, slot_key, sizeof(slot_key)) != sizeof(slot_key)) {
+        perror("read /dev/urandom");
+        exit(1);
+    }
+    close(fd);
+    
+    limiter_init(&ip_limiter, ip_rate);
+    limiter_init(&user_limiter, user_rate);
+}
+
+
+/*
+ * Take a token from the bucket in slot at time now. Every key that hashes
+ * to slot shares the bucket as it stands; slot_hash keeps an outsider
+ * from choosing which keys those are.
+ * Return 1 if there was a token, 0 otherwise.
+ */
+static int limiter_take(Limiter *limiter, unsigned int slot, long now) {
+    if (limiter->interval_ns == 0) {
+        return 1;
+    }
+
+    pthread_mutex_t *lock = &limiter->locks[slot & (LIMIT_STRIPES - 1)];
+    pthread_mutex_lock(lock);
+    Bucket *bucket = &limiter->slots[slot];
+    long full_at = bucket->full_at > now ? bucket->full_at : now;
+    int allowed = full_at - now <= limiter->burst_ns;
+    if (allowed) {
+        bucket->full_at = full_at + limiter->interval_ns;
+    }
+    pthread_mutex_unlock(lock);
+    return allowed;
+}
+
+
+/*
+ * Take a token from the bucket of addr and, unless name is empty, from the
+ * bucket of the user called name. Safe to call from any worker thread.
+ * Return 1 if the command may run, 0 if it must be refused.
+ */
+int limit_command(struct in_addr addr, const char *name) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long now = ts.tv_sec * 1000000000L + ts.tv_nsec;
+
+    if (!limiter_take(&ip_limiter,
+            slot_hash(&addr.s_addr, sizeof(addr.s_addr)), now)) {
+        return 0;
+    }
+    if (name[0] == '\0') {
+        return 1;
+    }
+    return limiter_take(&user_limiter, slot_hash(name, strlen(name)), now);
+}
@@ -0,0 +1,26 @@
+/*
+ * Rate limiting of commands, with one token bucket per client IP address
+ * and one per user. A bucket holds up to one second's worth of tokens and
+ * refills at the configured rate; a command that finds its bucket empty is
+ * refused instead of run.
+ *
+ * Buckets live in fixed-size tables indexed by a hash of the address or
+ * of the user's name, so memory stays bounded however many addresses
+ * connect. Keys that collide share one bucket. The hash is keyed with a
+ * secret drawn at startup, so a client cannot pick an address or a name
+ * that lands in someone else's slot and drain that bucket.
+ */
+
+/*
+ * Limit every IP address to ip_rate commands per second and every user to
+ * user_rate. A rate of 0 turns that limit off, and choose the secret key
+ * of the slot hash. Call before any worker starts.
+ */
+void limit_init(int ip_rate, int user_rate);
+
+/*
+ * Take a token from the bucket of addr and, unless name is empty, from the
+ * bucket of the user called name. Safe to call from any worker thread.
+ * Return 1 if the command may run, 0 if it must be refused.
+ */
+int limit_command(struct in_addr addr, const char *name);
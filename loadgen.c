@@ -0,0 +1,636 @@
+/*
+ * FriendMe load generator
+ *
+ * Opens many connections to a friends_server, logs each one in as its own
+ * user, befriends a few of the others, then issues a configurable mix of
+ * commands for a fixed time and reports throughput and latency percentiles
+ * per command.
+ *
+ * Every reply and notification the server sends ends with the "\r\n> "
+ * prompt. The text before a prompt is a reply when it is empty or ends in
+ * "\r\n", and a notification ("x says: ...") otherwise, which is how replies
+ * are matched to commands without understanding them.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef PORT
+  #define PORT 50472
+#endif
+
+#define MAX_NAME 32
+#define MAX_DEPTH 64            // most commands in flight per connection
+#define MAX_FRIENDS 64          // friends remembered per connection
+#define IN_CAP 65536            // bytes of unparsed input kept per connection
+#define MAX_EVENTS 256
+#define PROMPT "\r\n> "
+#define PROMPT_LEN 4
+
+// commands in the mix; the order matches cmd_names
+enum { CMD_MAKE_FRIENDS, CMD_POST, CMD_PROFILE, CMD_PROFILE_PAGE,
+       CMD_LIST_USERS, CMD_BROADCAST, NUM_CMDS };
+
+static const char *cmd_names[NUM_CMDS] = {
+    "make_friends", "post", "profile", "profile_page", "list_users",
+    "broadcast"
+};
+
+/*
+ * Latency samples of one command, in nanoseconds.
+ */
+typedef struct samples {
+    long *ns;
+    long len;
+    long cap;
+} Samples;
+
+/*
+ * One connection, logged in as user index id.
+ */
+typedef struct conn {
+    int fd;
+    int id;
+    int logged_in;
+    int friends[MAX_FRIENDS];   // ids of users it has befriended
+    int num_friends;
+    char in[IN_CAP];            // input not yet split into replies
+    int in_len;
+    int pending[MAX_DEPTH];     // commands awaiting replies, oldest first
+    long sent_at[MAX_DEPTH];
+    int head;
+    int count;
+} Conn;
+
+/*
+ * One load thread and the connections it drives.
+ */
+typedef struct gen {
+    int num_conns;
+    Conn *conns;
+    int epfd;
+    unsigned int seed;
+    Samples samples[NUM_CMDS];
+    long notifications;
+    long errors;
+    pthread_t thread;
+} Gen;
+
+// options
+static const char *host = "127.0.0.1";
+static int port = PORT;
+static int num_conns = 10;
+static int num_threads = 1;
+static int depth = 1;
+static int duration = 10;
+static int setup_friends = 3;
+static int post_bytes = 32;
+static int weights[NUM_CMDS] = {1, 5, 3, 1, 1, 0};
+static const char *prefix = "lg";
+
+static volatile int running = 1;
+static char *payload;
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+static long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * Store the name of user id in name, which holds MAX_NAME bytes.
+ */
+static void user_name(int id, char *name) {
+    snprintf(name, MAX_NAME, "%s%d", prefix, id);
+}
+
+
+/*
+ * Record a latency sample.
+ */
+static void add_sample(Samples *s, long ns) {
+    if (s->len == s->cap) {
+        s->cap = s->cap == 0 ? 4096 : s->cap * 2;
+        s->ns = realloc(s->ns, s->cap * sizeof(long));
+        if (s->ns == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    s->ns[s->len++] = ns;
+}
+
+
+/*
+ * Write all len bytes of buf to fd, which is blocking.
+ */
+static void send_all(int fd, const char *buf, int len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * If conn's input holds a complete prompt, return the text before it,
+ * NUL-terminated in place, and set *consumed to the bytes to drop once it
+ * has been handled. Return NULL otherwise.
+ */
+static char *next_unit(Conn *conn, int *consumed) {
+    char *prompt = memmem(conn->in, conn->in_len, PROMPT, PROMPT_LEN);
+    if (prompt == NULL) {
+        return NULL;
+    }
+    *prompt = '\0';
+    *consumed = prompt - conn->in + PROMPT_LEN;
+    return conn->in;
+}
+
+
+/*
+ * Drop the first n bytes of conn's input.
+ */
+static void consume(Conn *conn, int n) {
+    conn->in_len -= n;
+    memmove(conn->in, conn->in + n, conn->in_len);
+}
+
+
+/*
+ * Read whatever is available on conn into its buffer and return the number
+ * of bytes read. Exit if the server closes the connection.
+ */
+static int fill(Conn *conn, int flags) {
+    if (conn->in_len == IN_CAP) {
+        // a reply larger than the buffer: keep only its tail
+        consume(conn, IN_CAP / 2);
+    }
+    ssize_t n = recv(conn->fd, conn->in + conn->in_len,
+        IN_CAP - conn->in_len, flags);
+    if (n == 0) {
+        fprintf(stderr, "server closed connection %d\n", conn->id);
+        exit(1);
+    } else if (n == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return 0;
+        }
+        perror("recv");
+        exit(1);
+    }
+    conn->in_len += n;
+    return n;
+}
+
+
+/*
+ * Connect conn to the server and log in as its user, blocking until the
+ * server has greeted it.
+ */
+static void login(Conn *conn) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "bad host address %s\n", host);
+        exit(1);
+    }
+
+    if ((conn->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        exit(1);
+    }
+    if (connect(conn->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("connect");
+        exit(1);
+    }
+    int on = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    char name[MAX_NAME + 2];
+    user_name(conn->id, name);
+    strcat(name, "\r\n");
+    send_all(conn->fd, name, strlen(name));
+
+    // the greeting ends with the first prompt
+    int consumed;
+    while (next_unit(conn, &consumed) == NULL) {
+        fill(conn, 0);
+    }
+    consume(conn, consumed);
+    conn->logged_in = 1;
+}
+
+
+/*
+ * Block until conn receives a reply, skipping notifications. Return the
+ * reply text, valid until the next read on conn.
+ */
+static char *await_reply(Conn *conn, Gen *gen) {
+    static __thread char reply[256];
+    while (1) {
+        int consumed;
+        char *unit;
+        while ((unit = next_unit(conn, &consumed)) != NULL) {
+            int len = strlen(unit);
+            int is_reply = len == 0 || (len >= 2 && unit[len - 1] == '\n');
+            int n = len < (int)sizeof(reply) - 1 ? len : sizeof(reply) - 1;
+            memcpy(reply, unit, n);
+            reply[n] = '\0';
+            consume(conn, consumed);
+            if (is_reply) {
+                return reply;
+            }
+            gen->notifications++;
+        }
+        fill(conn, 0);
+    }
+}
+
+
+/*
+ * Pick a random command according to the configured weights.
+ */
+static int pick_command(Gen *gen) {
+    int total = 0;
+    for (int i = 0; i < NUM_CMDS; i++) {
+        total += weights[i];
+    }
+    int r = rand_r(&gen->seed) % total;
+    for (int i = 0; i < NUM_CMDS; i++) {
+        if (r < weights[i]) {
+            return i;
+        }
+        r -= weights[i];
+    }
+    return NUM_CMDS - 1;
+}
+
+
+/*
+ * Send one random command on conn and remember when it was sent.
+ */
+static void send_command(Gen *gen, Conn *conn) {
+    char line[MAX_NAME * 2 + 64 + post_bytes];
+    char name[MAX_NAME];
+    int cmd = pick_command(gen);
+    int other = rand_r(&gen->seed) % num_conns;
+    user_name(other, name);
+
+    switch (cmd) {
+        case CMD_MAKE_FRIENDS:
+            snprintf(line, sizeof(line), "make_friends %s\r\n", name);
+            break;
+        case CMD_POST:
+            // post to a friend when there is one, so most posts succeed
+            if (conn->num_friends > 0) {
+                user_name(conn->friends[rand_r(&gen->seed) % conn->num_friends],
+                    name);
+            }
+            snprintf(line, sizeof(line), "post %s %s\r\n", name, payload);
+            break;
+        case CMD_PROFILE:
+            snprintf(line, sizeof(line), "profile %s\r\n", name);
+            break;
+        case CMD_PROFILE_PAGE:
+            snprintf(line, sizeof(line), "profile %s 0 10\r\n", name);
+            break;
+        case CMD_BROADCAST:
+            snprintf(line, sizeof(line), "broadcast %s\r\n", payload);
+            break;
+        default:
+            snprintf(line, sizeof(line), "list_users\r\n");
+            break;
+    }
+
+    int slot = (conn->head + conn->count) % MAX_DEPTH;
+    conn->pending[slot] = cmd;
+    conn->sent_at[slot] = now_ns();
+    conn->count++;
+    send_all(conn->fd, line, strlen(line));
+}
+
+
+/*
+ * Match every complete reply buffered on conn to the oldest command in
+ * flight, record its latency, and send a replacement while running.
+ */
+static void handle_replies(Gen *gen, Conn *conn) {
+    int consumed;
+    char *unit;
+    while ((unit = next_unit(conn, &consumed)) != NULL) {
+        int len = strlen(unit);
+        int is_reply = len == 0 || (len >= 2 && unit[len - 1] == '\n');
+        if (!is_reply) {
+            gen->notifications++;
+        } else if (conn->count > 0) {
+            int cmd = conn->pending[conn->head];
+            add_sample(&gen->samples[cmd], now_ns() - conn->sent_at[conn->head]);
+            if (strncmp(unit, "Error:", 6) == 0) {
+                gen->errors++;
+            }
+            conn->head = (conn->head + 1) % MAX_DEPTH;
+            conn->count--;
+        }
+        consume(conn, consumed);
+        if (running && conn->count < depth) {
+            send_command(gen, conn);
+        }
+    }
+}
+
+
+/*
+ * Load thread, first phase: log every connection in.
+ */
+static void *run_logins(void *arg) {
+    Gen *gen = arg;
+    for (int i = 0; i < gen->num_conns; i++) {
+        login(&gen->conns[i]);
+    }
+    return NULL;
+}
+
+
+/*
+ * Load thread, second phase: befriend a few random users from every
+ * connection so that posts have targets.
+ */
+static void *run_friends(void *arg) {
+    Gen *gen = arg;
+    for (int i = 0; i < gen->num_conns; i++) {
+        Conn *conn = &gen->conns[i];
+        for (int k = 0; k < setup_friends && num_conns > 1; k++) {
+            int other = rand_r(&gen->seed) % num_conns;
+            if (other == conn->id) {
+                continue;
+            }
+            char line[MAX_NAME + 32], name[MAX_NAME];
+            user_name(other, name);
+            snprintf(line, sizeof(line), "make_friends %s\r\n", name);
+            send_all(conn->fd, line, strlen(line));
+            char *reply = await_reply(conn, gen);
+            if ((strncmp(reply, "You are now friends", 19) == 0
+                    || strstr(reply, "already friends") != NULL)
+                    && conn->num_friends < MAX_FRIENDS) {
+                conn->friends[conn->num_friends++] = other;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Load thread, measured phase: keep depth commands in flight on every
+ * connection until time is up, then wait for the outstanding replies.
+ */
+static void *run_load(void *arg) {
+    Gen *gen = arg;
+    if ((gen->epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    for (int i = 0; i < gen->num_conns; i++) {
+        Conn *conn = &gen->conns[i];
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(gen->epfd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+            perror("epoll_ctl");
+            exit(1);
+        }
+        for (int k = 0; k < depth; k++) {
+            send_command(gen, conn);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    long in_flight = 1;
+    while (running || in_flight > 0) {
+        int n = epoll_wait(gen->epfd, events, MAX_EVENTS, 100);
+        for (int i = 0; i < n; i++) {
+            Conn *conn = events[i].data.ptr;
+            fill(conn, MSG_DONTWAIT);
+            handle_replies(gen, conn);
+        }
+        if (!running) {
+            // stop once every outstanding reply has arrived
+            in_flight = 0;
+            for (int i = 0; i < gen->num_conns; i++) {
+                in_flight += gen->conns[i].count;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Run fn on every load thread and wait for all of them.
+ */
+static void run_phase(Gen *gens, void *(*fn)(void *)) {
+    for (int t = 0; t < num_threads; t++) {
+        int err = pthread_create(&gens[t].thread, NULL, fn, &gens[t]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(gens[t].thread, NULL);
+    }
+}
+
+
+static int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * Return the p-th percentile of the sorted samples, in microseconds.
+ */
+static double percentile(const Samples *s, double p) {
+    if (s->len == 0) {
+        return 0;
+    }
+    long i = (long)(p / 100.0 * (s->len - 1) + 0.5);
+    return s->ns[i] / 1000.0;
+}
+
+
+/*
+ * Parse a command mix such as "post=5,profile=3" into weights. Commands
+ * that are not named get weight 0.
+ */
+static void parse_mix(char *mix) {
+    for (int i = 0; i < NUM_CMDS; i++) {
+        weights[i] = 0;
+    }
+    char *saveptr;
+    for (char *item = strtok_r(mix, ",", &saveptr); item != NULL;
+            item = strtok_r(NULL, ",", &saveptr)) {
+        char *eq = strchr(item, '=');
+        int i;
+        if (eq != NULL) {
+            *eq = '\0';
+        }
+        for (i = 0; i < NUM_CMDS && strcmp(cmd_names[i], item) != 0; i++);
+        if (i == NUM_CMDS) {
+            fprintf(stderr, "unknown command in mix: %s\n", item);
+            exit(1);
+        }
+        weights[i] = eq != NULL ? atoi(eq + 1) : 1;
+    }
+}
+
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [-h host] [-p port] [-c connections] [-T threads]\n"
+        "          [-D depth] [-d seconds] [-f friends] [-b post_bytes]\n"
+        "          [-m cmd=weight,...] [-P name_prefix]\n"
+        "Commands: make_friends post profile profile_page list_users"
+        " broadcast\n",
+        prog);
+    exit(1);
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:T:D:d:f:b:m:P:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': num_conns = atoi(optarg); break;
+            case 'T': num_threads = atoi(optarg); break;
+            case 'D': depth = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); break;
+            case 'f': setup_friends = atoi(optarg); break;
+            case 'b': post_bytes = atoi(optarg); break;
+            case 'm': parse_mix(optarg); break;
+            case 'P': prefix = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (num_conns < 1 || num_threads < 1 || depth < 1 || depth > MAX_DEPTH
+            || post_bytes < 1 || strlen(prefix) > MAX_NAME - 12) {
+        usage(argv[0]);
+    }
+    int total_weight = 0;
+    for (int i = 0; i < NUM_CMDS; i++) {
+        total_weight += weights[i];
+    }
+    if (total_weight <= 0) {
+        usage(argv[0]);
+    }
+    if (num_threads > num_conns) {
+        num_threads = num_conns;
+    }
+
+    payload = malloc(post_bytes + 1);
+    for (int i = 0; i < post_bytes; i++) {
+        payload[i] = 'a' + i % 26;
+    }
+    payload[post_bytes] = '\0';
+
+    // spread the connections evenly over the threads
+    Conn *conns = calloc(num_conns, sizeof(Conn));
+    Gen *gens = calloc(num_threads, sizeof(Gen));
+    if (conns == NULL || gens == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < num_conns; i++) {
+        conns[i].id = i;
+    }
+    for (int t = 0, first = 0; t < num_threads; t++) {
+        gens[t].num_conns = num_conns / num_threads
+            + (t < num_conns % num_threads);
+        gens[t].conns = conns + first;
+        gens[t].seed = 12345 + t;
+        first += gens[t].num_conns;
+    }
+
+    long start = now_ns();
+    run_phase(gens, run_logins);
+    run_phase(gens, run_friends);
+    printf("setup: %d connections logged in and befriended in %.2fs\n",
+        num_conns, (now_ns() - start) / 1e9);
+
+    start = now_ns();
+    for (int t = 0; t < num_threads; t++) {
+        int err = pthread_create(&gens[t].thread, NULL, run_load, &gens[t]);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            exit(1);
+        }
+    }
+    sleep(duration);
+    running = 0;
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(gens[t].thread, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // merge every thread's samples and report
+    long total = 0, notifications = 0, errors = 0;
+    printf("%d connections, depth %d, %.2fs\n", num_conns, depth, elapsed);
+    printf("%-14s %10s %10s %10s %10s %10s %10s\n", "command", "count",
+        "ops/s", "p50 us", "p99 us", "p999 us", "max us");
+    for (int c = 0; c < NUM_CMDS; c++) {
+        Samples all = {NULL, 0, 0};
+        for (int t = 0; t < num_threads; t++) {
+            for (long i = 0; i < gens[t].samples[c].len; i++) {
+                add_sample(&all, gens[t].samples[c].ns[i]);
+            }
+        }
+        if (all.len == 0) {
+            continue;
+        }
+        qsort(all.ns, all.len, sizeof(long), compare_long);
+        printf("%-14s %10ld %10.0f %10.1f %10.1f %10.1f %10.1f\n",
+            cmd_names[c], all.len, all.len / elapsed, percentile(&all, 50),
+            percentile(&all, 99), percentile(&all, 99.9),
+            all.ns[all.len - 1] / 1000.0);
+        total += all.len;
+        free(all.ns);
+    }
+    for (int t = 0; t < num_threads; t++) {
+        notifications += gens[t].notifications;
+        errors += gens[t].errors;
+    }
+    printf("%-14s %10ld %10.0f   (%ld error replies, %ld notifications)\n",
+        "total", total, total / elapsed, errors, notifications);
+    return 0;
+}
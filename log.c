@@ -0,0 +1,187 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+#define LOG_SLOT_BITS 12
+#define LOG_SLOTS (1 << LOG_SLOT_BITS)  // lines the ring holds
+#define LOG_LINE 248                    // longest line kept, newline included
+#define LOG_FLUSH_MS 10                 // longest a line waits to be written
+#define LOG_BATCH 65536                 // bytes gathered per write
+
+/*
+ * One line in the ring. turn tells producers and the flusher whose it is:
+ * on lap n of the ring (n = position / LOG_SLOTS) the slot is free for a
+ * producer while turn is 2n, and ready for the flusher once it is 2n + 1.
+ * The flusher sets it to 2n + 2 when done, handing it to lap n + 1. Zero is
+ * therefore a valid initial state and no setup is needed before logging.
+ */
+typedef struct log_slot {
+    unsigned long turn;
+    int len;
+    char text[LOG_LINE];
+} LogSlot;
+
+int log_level = LOG_INFO;
+
+static LogSlot ring[LOG_SLOTS];
+static unsigned long head = 0;      // next position producers claim
+static unsigned long tail = 0;      // next position the flusher reads
+static long dropped = 0;
+
+
+/*
+ * Return the level named by name ("error", "warn", "info" or "debug"), or
+ * -1 if there is no such level.
+ */
+int log_parse_level(const char *name) {
+    static const char *names[] = {"error", "warn", "info", "debug"};
+    for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * Format a line at level, printf style, and queue it for writing. The line
+ * should not end in a newline; one is added.
+ */
+void log_msg(int level, const char *fmt, ...) {
+    if (level > log_level) {
+        return;
+    }
+
+    // claim the next position, unless its slot still holds an unwritten line
+    unsigned long pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    LogSlot *slot;
+    while (1) {
+        slot = &ring[pos & (LOG_SLOTS - 1)];
+        unsigned long want = (pos >> LOG_SLOT_BITS) * 2;
+        unsigned long turn = __atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE);
+        if (turn == want) {
+            if (__atomic_compare_exchange_n(&head, &pos, pos + 1, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (turn < want) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(slot->text, LOG_LINE - 1, fmt, ap);
+    va_end(ap);
+    if (len < 0) {
+        len = 0;
+    } else if (len > LOG_LINE - 2) {
+        len = LOG_LINE - 2;     // truncated
+    }
+    slot->text[len++] = '\n';
+    slot->len = len;
+    __atomic_store_n(&slot->turn, (pos >> LOG_SLOT_BITS) * 2 + 1,
+        __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Return the number of lines dropped because the ring was full.
+ */
+long log_dropped(void) {
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Write len bytes of buf to stdout. Errors are ignored: there is nowhere
+ * left to report them.
+ */
+static void write_out(const char *buf, int len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+
+/*
+ * Write every line that is ready, in order, batching them into as few
+ * writes as possible. Stop at the first line that was claimed but is still
+ * being formatted; it goes out on the next pass.
+ */
+static void flush_ring(void) {
+    static char batch[LOG_BATCH];
+    static long reported = 0;
+    int len = 0;
+
+    while (1) {
+        LogSlot *slot = &ring[tail & (LOG_SLOTS - 1)];
+        unsigned long lap = tail >> LOG_SLOT_BITS;
+        if (__atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE) != lap * 2 + 1) {
+            break;
+        }
+        if (len + slot->len > LOG_BATCH) {
+            write_out(batch, len);
+            len = 0;
+        }
+        memcpy(batch + len, slot->text, slot->len);
+        len += slot->len;
+        __atomic_store_n(&slot->turn, lap * 2 + 2, __ATOMIC_RELEASE);
+        tail++;
+    }
+
+    long now_dropped = log_dropped();
+    if (now_dropped != reported && len + LOG_LINE <= LOG_BATCH) {
+        len += snprintf(batch + len, LOG_LINE, "log: dropped %ld line%s\n",
+            now_dropped - reported, now_dropped - reported == 1 ? "" : "s");
+        reported = now_dropped;
+    }
+    write_out(batch, len);
+}
+
+
+/*
+ * Flusher thread: write out the queued lines every LOG_FLUSH_MS.
+ */
+static void *run_flusher(void *arg) {
+    struct timespec interval = {0, LOG_FLUSH_MS * 1000000L};
+    while (1) {
+        flush_ring();
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+
+/*
+ * Start the flusher thread. Lines logged before this are buffered too.
+ */
+void log_start(void) {
+    pthread_t flusher;
+    int err = pthread_create(&flusher, NULL, run_flusher, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+    pthread_detach(flusher);
+}
@@ -0,0 +1,36 @@
+/*
+ * Asynchronous logging. log_msg formats a line into a slot of a bounded
+ * lock-free ring and returns; a background thread writes whatever has
+ * accumulated to stdout every LOG_FLUSH_MS, in one write per batch. A
+ * request thread therefore never waits on a slow terminal or pipe: if the
+ * ring fills up, lines are dropped and counted instead.
+ */
+
+// levels, most severe first; a line is kept if its level <= log_level
+enum { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+// lines less severe than this are discarded before formatting
+extern int log_level;
+
+/*
+ * Start the flusher thread. Lines logged before this are buffered too.
+ */
+void log_start(void);
+
+/*
+ * Return the level named by name ("error", "warn", "info" or "debug"), or
+ * -1 if there is no such level.
+ */
+int log_parse_level(const char *name);
+
+/*
+ * Format a line at level, printf style, and queue it for writing. The line
+ * should not end in a newline; one is added.
+ */
+void log_msg(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/*
+ * Return the number of lines dropped because the ring was full.
+ */
+long log_dropped(void);
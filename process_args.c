@@ -1,156 +1,650 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include "friends.h"
-#include "friends_server.h"
-
-#define INPUT_BUFFER_SIZE 256
-#define INPUT_ARG_MAX_NUM 12
-#define DELIM " \n"
-
-
-/*
- * Find a client with the given name. Return NULL if no such client exists.
- */
-Client *find_client(char *name, Client **top) {
-    
-    // find client with given fd
-    Client **client = top;
-    while (*client != NULL) {
-        if (strcmp((*client)->name, name) == 0) {   // name matches
-            return *client;                         // return client
-        }
-        client = &(*client)->next;
-    }
-    
-    return NULL;
-}
-
-
-/*
- * Tokenize the string stored in cmd.
- * Return the number of tokens, and store the tokens in cmd_argv.
- */
-int tokenize(char *cmd, char **cmd_argv) {
-    int cmd_argc = 0;
-    char *next_token = strtok(cmd, DELIM);    
-    while (next_token != NULL) {
-        if (cmd_argc >= INPUT_ARG_MAX_NUM - 1) {
-            error("Too many arguments!", STDOUT_FILENO);
-            cmd_argc = 0;
-            break;
-        }
-        cmd_argv[cmd_argc] = next_token;
-        cmd_argc++;
-        next_token = strtok(NULL, DELIM);
-    }
-
-    return cmd_argc;
-}
-
-
-/* 
- * Read and process commands
- * Return:  -1 for quit command
- *          0 otherwise
- */
-int process_args(int cmd_argc, char **cmd_argv, User **user_list_ptr, 
-        Client *client, Client **top) {
-    User *user_list = *user_list_ptr;
-
-    if (cmd_argc <= 0) {
-        return 0;
-    } else if (strcmp(cmd_argv[0], "quit") == 0 && cmd_argc == 1) {
-        return -1;
-
-    } else if (strcmp(cmd_argv[0], "list_users") == 0 && cmd_argc == 1) {
-        char *buf = list_users(user_list);
-        write(client->fd, buf, strlen(buf));
-        free(buf);
-
-    } else if (strcmp(cmd_argv[0], "make_friends") == 0 && cmd_argc == 2) {
-        switch (make_friends(client->name, cmd_argv[1], user_list)) {
-            case 0:
-            {
-                Client *other = find_client(cmd_argv[1], top);
-                char buf[100];
-                sprintf(buf, "You are now friends with %s.\r\n", cmd_argv[1]);
-                write(client->fd, buf, strlen(buf));
-                if (other) {
-                    sprintf(buf, "%s has added you as a friend.\r\n> ", 
-                        client->name);
-                    write(other->fd, buf, strlen(buf));
-                }
-            }    
-                break;
-            case 1:
-                error("you are already friends", client->fd);
-                break;
-            case 2:
-                error("at least one of you has the max number of friends", 
-                    client->fd);
-                break;
-            case 3:
-                error("you cannot befriend yourself", client->fd);
-                break;
-            case 4:
-                error("the user you entered does not exist", client->fd);
-                break;
-        }
-    } else if (strcmp(cmd_argv[0], "post") == 0 && cmd_argc >= 3) {
-        // first determine how long a string we need
-        int space_needed = 0;
-        for (int i = 2; i < cmd_argc; i++) {
-            space_needed += strlen(cmd_argv[i]) + 1;
-        }
-
-        // allocate the space
-        char *contents = malloc(space_needed);
-        if (contents == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-
-        // copy in the bits to make a single string
-        strcpy(contents, cmd_argv[2]);
-        for (int i = 3; i < cmd_argc; i++) {
-            strcat(contents, " ");
-            strcat(contents, cmd_argv[i]);
-        }
-
-        User *author = find_user(client->name, user_list);
-        User *target = find_user(cmd_argv[1], user_list);
-        switch (make_post(author, target, contents)) {
-            case 0:
-            {
-                Client *other = find_client(cmd_argv[1], top);
-                if (other) {
-                    char buf[INPUT_BUFFER_SIZE];
-                    sprintf(buf, "%s says: %s\r\n> ", client->name, contents);
-                    write(other->fd, buf, strlen(buf));
-                }
-            }    
-                break;
-            case 1:
-                error("you are not friends with this user", client->fd);
-                break;
-            case 2:
-                error("the user you entered does not exist", client->fd);
-                break;
-        }
-    } else if (strcmp(cmd_argv[0], "profile") == 0 && cmd_argc == 2) {
-        User *user = find_user(cmd_argv[1], user_list);
-        if (user == NULL) {
-            error("user not found", client->fd);
-        } else {
-            char *buf = print_user(user);
-            write(client->fd, buf, strlen(buf));
-            free(buf);
-        }
-    } else {
-        error("Incorrect syntax", client->fd);
-    }
-    
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include "friends.h"
+#include "friends_server.h"
+#include "stats.h"
+#include "search.h"
+
+#define PAGE_DEFAULT 10         // posts per profile page when no limit is given
+#define PAGE_MAX 100            // most posts a single profile page may hold
+#define LIST_PAGE_DEFAULT 100   // users per list_users page when no limit is given
+#define LIST_PAGE_MAX 1000      // most users a single list_users page may hold
+#define SUGGEST_DEFAULT 10      // suggestions shown when no count is given
+#define FEED_DEFAULT 10         // feed posts shown when no count is given
+#define SEARCH_DEFAULT 10       // search results shown
+
+
+#define SESSION_MIN_BUCKETS 64   // initial number of session index buckets
+
+/*
+ * Chained hash index from a logged-in username to its Client sessions.
+ * Every session of a user hashes to the same bucket, so walking the bucket
+ * from the first match finds all of them.
+ */
+static pthread_rwlock_t sessions_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Client **sessions = NULL;
+static unsigned int session_buckets = 0;    // always a power of two
+static unsigned int session_count = 0;
+
+
+/*
+ * Grow the session index to new_buckets buckets and rehash every session.
+ */
+static void session_resize(unsigned int new_buckets) {
+    Client **old = sessions;
+    unsigned int old_buckets = session_buckets;
+
+    sessions = calloc(new_buckets, sizeof(Client *));
+    if (sessions == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    session_buckets = new_buckets;
+
+    for (unsigned int i = 0; i < old_buckets; i++) {
+        Client *client = old[i];
+        while (client != NULL) {
+            Client *next = client->session_next;
+            unsigned int b = hash_name(client->name) & (new_buckets - 1);
+            client->session_next = sessions[b];
+            sessions[b] = client;
+            client = next;
+        }
+    }
+    free(old);
+}
+
+
+/*
+ * Add a client that has just logged in to the session index.
+ */
+void add_session(Client *client) {
+    pthread_rwlock_wrlock(&sessions_lock);
+    if (session_count + 1 > session_buckets) {
+        session_resize(session_buckets == 0 ? SESSION_MIN_BUCKETS
+            : session_buckets * 2);
+    }
+    unsigned int b = hash_name(client->name) & (session_buckets - 1);
+    client->session_next = sessions[b];
+    sessions[b] = client;
+    session_count++;
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+
+/*
+ * Remove a logged-in client from the session index.
+ */
+void remove_session(Client *client) {
+    pthread_rwlock_wrlock(&sessions_lock);
+    if (session_buckets == 0) {
+        pthread_rwlock_unlock(&sessions_lock);
+        return;
+    }
+    Client **curr = &sessions[hash_name(client->name) & (session_buckets - 1)];
+    while (*curr != NULL && *curr != client) {
+        curr = &(*curr)->session_next;
+    }
+    if (*curr != NULL) {
+        *curr = client->session_next;
+        client->session_next = NULL;
+        session_count--;
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+
+/*
+ * Return the first client in the chain starting at client that is logged in
+ * with the given name, or NULL if there is none.
+ */
+static Client *match_session(Client *client, const char *name) {
+    while (client != NULL && strcmp(client->name, name) != 0) {
+        client = client->session_next;
+    }
+    return client;
+}
+
+
+/*
+ * Find a client with the given name. Return NULL if no such client exists.
+ */
+Client *find_client(const char *name) {
+    if (session_buckets == 0) {
+        return NULL;
+    }
+    return match_session(sessions[hash_name(name) & (session_buckets - 1)],
+        name);
+}
+
+
+/*
+ * Return the next client logged in with the same name as client, or NULL if
+ * client is the last one.
+ */
+Client *find_next_client(Client *client) {
+    return match_session(client->session_next, client->name);
+}
+
+
+/*
+ * Queue len bytes of msg to every client logged in as name. Safe to call
+ * from any worker thread: the session lock keeps the clients from being
+ * removed while the message is queued.
+ */
+void notify_user(const char *name, const char *msg, int len) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    for (Client *other = find_client(name); other != NULL;
+            other = find_next_client(other)) {
+        client_notify(other, msg, len);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+
+/*
+ * Queue the iovcnt pieces of iov, as one message, to every client logged in
+ * as name. Safe to call from any worker thread.
+ */
+void notify_userv(const char *name, const struct iovec *iov, int iovcnt) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    for (Client *other = find_client(name); other != NULL;
+            other = find_next_client(other)) {
+        client_notifyv(other, iov, iovcnt);
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+
+/*
+ * Queue the iovcnt pieces of iov, as one message, to every client logged in
+ * as any of the count users, taking the session lock once. Safe to call
+ * from any worker thread.
+ */
+void notify_users(User **users, int count, const struct iovec *iov,
+        int iovcnt) {
+    pthread_rwlock_rdlock(&sessions_lock);
+    for (int i = 0; i < count; i++) {
+        for (Client *other = find_client(users[i]->name); other != NULL;
+                other = find_next_client(other)) {
+            client_notifyv(other, iov, iovcnt);
+        }
+    }
+    pthread_rwlock_unlock(&sessions_lock);
+}
+
+
+/*
+ * Join cmd_argv[first] to cmd_argv[cmd_argc - 1] with single spaces into a
+ * new post body, copying each token once.
+ */
+static Str *join_post_text(int cmd_argc, const Token *cmd_argv, int first) {
+    int len = -1;
+    for (int i = first; i < cmd_argc; i++) {
+        len += cmd_argv[i].len + 1;
+    }
+
+    Str *text = new_post_text(len);
+    char *out = text->text;
+    for (int i = first; i < cmd_argc; i++) {
+        if (i > first) {
+            *out++ = ' ';
+        }
+        memcpy(out, cmd_argv[i].text, cmd_argv[i].len);
+        out += cmd_argv[i].len;
+    }
+    return text;
+}
+
+
+/*
+ * Point iov at the pieces of the notification "<name> says: <text>\r\n> ",
+ * so that it can be queued without formatting a copy of text.
+ */
+static void says_iov(struct iovec iov[4], const char *name, const Str *text) {
+    iov[0].iov_base = (char *)name;
+    iov[0].iov_len = strlen(name);
+    iov[1].iov_base = " says: ";
+    iov[1].iov_len = 7;
+    iov[2].iov_base = (char *)text->text;
+    iov[2].iov_len = text->len;
+    iov[3].iov_base = "\r\n> ";
+    iov[3].iov_len = 4;
+}
+
+
+/*
+ * ProfileSink that sends a cached profile or directory slice straight to the
+ * client in arg.
+ */
+static void send_profile(void *arg, const struct iovec *iov, int iovcnt) {
+    client_sendv(arg, iov, iovcnt);
+}
+
+
+/*
+ * Parse a non-negative decimal count from str into *count.
+ * Return 0 on success, -1 if str is not a valid count.
+ */
+static int parse_count(const char *str, int *count) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    *count = value;
+    return 0;
+}
+
+
+/*
+ * Split the len bytes of cmd into tokens separated by runs of spaces, in
+ * place: each token is NUL-terminated where it lies in cmd and recorded in
+ * cmd_argv with its length, so nothing is copied or measured twice. Uses no
+ * state outside its arguments, so workers may tokenize concurrently.
+ * Return the number of tokens, or -1 if there are more than max_tokens.
+ */
+int tokenize(char *cmd, int len, Token *cmd_argv, int max_tokens) {
+    int cmd_argc = 0;
+    char *end = cmd + len;
+    while (1) {
+        while (cmd < end && (*cmd == ' ' || *cmd == '\n')) {
+            cmd++;
+        }
+        if (cmd == end) {
+            return cmd_argc;
+        }
+        if (cmd_argc == max_tokens) {
+            return -1;
+        }
+        char *token = cmd;
+        while (cmd < end && *cmd != ' ' && *cmd != '\n') {
+            cmd++;
+        }
+        cmd_argv[cmd_argc].text = token;
+        cmd_argv[cmd_argc].len = cmd - token;
+        cmd_argc++;
+        if (cmd < end) {
+            *cmd++ = '\0';
+        }
+    }
+}
+
+
+/*
+ * Handler for one command. cmd_argv[0] is the command's name, and cmd_argc
+ * is within the arity it was registered with.
+ * Return -1 to log the client out, 0 otherwise.
+ */
+typedef int (*CommandHandler)(int cmd_argc, const Token *cmd_argv,
+        User *user_list, Client *client);
+
+/*
+ * One entry in the command table.
+ */
+typedef struct command {
+    const char *name;
+    int name_len;
+    int id;             // STAT_* id its latency is recorded under
+    int min_args;       // fewest tokens accepted, the name included
+    int max_args;       // most tokens accepted, or 0 for no limit
+    CommandHandler handler;
+} Command;
+
+#define COMMAND(name, id, min_args, max_args, handler) \
+    {name, sizeof(name) - 1, id, min_args, max_args, handler}
+
+
+/*
+ * quit
+ */
+static int cmd_quit(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    return -1;
+}
+
+
+/*
+ * list_users [cursor [limit]]: every user, or one page of them.
+ */
+static int cmd_list_users(int cmd_argc, const Token *cmd_argv,
+        User *user_list, Client *client) {
+    int cursor = 0, limit = -1;
+    if (cmd_argc >= 2 && (parse_count(cmd_argv[1].text, &cursor) == -1
+            || (cmd_argc == 3 && parse_count(cmd_argv[2].text, &limit) == -1))) {
+        error("Incorrect syntax", client);
+        return 0;
+    }
+    if (cmd_argc >= 2 && (limit == -1 || limit > LIST_PAGE_MAX)) {
+        limit = cmd_argc == 2 ? LIST_PAGE_DEFAULT : LIST_PAGE_MAX;
+    }
+    int count = send_users(user_list, cursor, limit, send_profile, client);
+    if (limit > 0 && count - limit > cursor) {
+        char buf[40];
+        int len = snprintf(buf, sizeof(buf), "Next cursor: %d\r\n",
+            cursor + limit);
+        client_send(client, buf, len);
+    }
+    return 0;
+}
+
+
+/*
+ * make_friends <user>
+ */
+static int cmd_make_friends(int cmd_argc, const Token *cmd_argv,
+        User *user_list, Client *client) {
+    const char *name = cmd_argv[1].text;
+    switch (make_friends(client->name, name, user_list)) {
+        case 0:
+        {
+            char buf[100];
+            sprintf(buf, "You are now friends with %s.\r\n", name);
+            client_send(client, buf, strlen(buf));
+
+            // notify every session the new friend has open
+            sprintf(buf, "%s has added you as a friend.\r\n> ", client->name);
+            notify_user(name, buf, strlen(buf));
+        }
+            break;
+        case 1:
+            error("you are already friends", client);
+            break;
+        case 2:
+            error("at least one of you has the max number of friends",
+                client);
+            break;
+        case 3:
+            error("you cannot befriend yourself", client);
+            break;
+        case 4:
+            error("the user you entered does not exist", client);
+            break;
+    }
+    return 0;
+}
+
+
+/*
+ * post <user> <message>
+ */
+static int cmd_post(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    // the post, its notification and the profile all share this body
+    Str *contents = join_post_text(cmd_argc, cmd_argv, 2);
+
+    User *author = find_user(client->name, user_list);
+    User *target = find_user(cmd_argv[1].text, user_list);
+    switch (make_post(author, target, contents)) {
+        case 0:
+        {
+            struct iovec iov[4];
+            says_iov(iov, client->name, contents);
+            notify_userv(cmd_argv[1].text, iov, 4);
+        }
+            break;
+        case 1:
+            error("you are not friends with this user", client);
+            break;
+        case 2:
+            error("the user you entered does not exist", client);
+            break;
+    }
+    release_post_text(contents);
+    return 0;
+}
+
+
+/*
+ * broadcast <message>: post to every friend, all sharing one body.
+ */
+static int cmd_broadcast(int cmd_argc, const Token *cmd_argv,
+        User *user_list, Client *client) {
+    Str *contents = join_post_text(cmd_argc, cmd_argv, 1);
+
+    User **targets;
+    User *author = find_user(client->name, user_list);
+    int count = broadcast_post(author, contents, &targets);
+    if (count <= 0) {
+        error("you have no friends to broadcast to", client);
+    } else {
+        // one notification, queued to every online friend and sent with
+        // each worker's next batch of writes
+        struct iovec iov[4];
+        says_iov(iov, client->name, contents);
+        notify_users(targets, count, iov, 4);
+
+        char reply[48];
+        int len = snprintf(reply, sizeof(reply),
+            "Posted to %d friend%s.\r\n", count, count == 1 ? "" : "s");
+        client_send(client, reply, len);
+    }
+    free(targets);
+    release_post_text(contents);
+    return 0;
+}
+
+
+/*
+ * profile <user> [offset [limit]]: the whole profile, or one page of the
+ * newest posts.
+ */
+static int cmd_profile(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    User *user = find_user(cmd_argv[1].text, user_list);
+    if (cmd_argc == 2) {
+        if (user == NULL) {
+            error("user not found", client);
+        } else {
+            send_user(user, send_profile, client);
+        }
+        return 0;
+    }
+
+    int offset, limit = PAGE_DEFAULT;
+    if (parse_count(cmd_argv[2].text, &offset) == -1
+            || (cmd_argc == 4 && parse_count(cmd_argv[3].text, &limit) == -1)) {
+        error("Incorrect syntax", client);
+    } else if (user == NULL) {
+        error("user not found", client);
+    } else {
+        if (limit > PAGE_MAX) {
+            limit = PAGE_MAX;
+        }
+        send_user_page(user, offset, limit, send_profile, client);
+    }
+    return 0;
+}
+
+
+/*
+ * suggest [k]: the k users sharing the most friends with the client's user.
+ */
+static int cmd_suggest(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    int k = SUGGEST_DEFAULT;
+    if (cmd_argc == 2 && parse_count(cmd_argv[1].text, &k) == -1) {
+        error("Incorrect syntax", client);
+        return 0;
+    }
+
+    Suggestion suggestions[SUGGEST_MAX];
+    User *user = find_user(client->name, user_list);
+    int count = suggest_friends(user, k, suggestions);
+    if (count == 0) {
+        if (k > 0) {
+            error("no friends of friends to suggest", client);
+        }
+        return 0;
+    }
+
+    // "<name> (<n> mutual friend[s])\r\n" per suggestion
+    char buf[count * (MAX_NAME + 32)];
+    int len = 0;
+    for (int i = 0; i < count; i++) {
+        len += sprintf(buf + len, "%s (%d mutual friend%s)\r\n",
+            suggestions[i].user->name, suggestions[i].mutual,
+            suggestions[i].mutual == 1 ? "" : "s");
+    }
+    client_send(client, buf, len);
+    return 0;
+}
+
+
+/*
+ * feed [n]: the n newest posts on the profiles of the client's user and its
+ * friends.
+ */
+static int cmd_feed(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    int n = FEED_DEFAULT;
+    if (cmd_argc == 2 && parse_count(cmd_argv[1].text, &n) == -1) {
+        error("Incorrect syntax", client);
+        return 0;
+    }
+
+    User *user = find_user(client->name, user_list);
+    if (send_feed(user, n, send_profile, client) == 0 && n > 0) {
+        error("your feed is empty", client);
+    } else if (n > 0) {
+        client_send(client, "\r\n", 2);
+    }
+    return 0;
+}
+
+
+/*
+ * search <term...>: the newest posts containing every term.
+ */
+static int cmd_search(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    const char *words[cmd_argc - 1];
+    for (int i = 1; i < cmd_argc; i++) {
+        words[i - 1] = cmd_argv[i].text;
+    }
+
+    FeedItem found[SEARCH_DEFAULT];
+    int count = search_posts(words, cmd_argc - 1, SEARCH_DEFAULT, found);
+    if (count == -1) {
+        error("search terms must contain letters or digits", client);
+    } else if (count == 0) {
+        error("no posts match", client);
+    } else {
+        send_posts(found, count, send_profile, client);
+        client_send(client, "\r\n", 2);
+    }
+    return 0;
+}
+
+
+/*
+ * stats
+ */
+static int cmd_stats(int cmd_argc, const Token *cmd_argv, User *user_list,
+        Client *client) {
+    char *report = stats_report(__atomic_load_n(&num_clients,
+        __ATOMIC_RELAXED));
+    client_send(client, report, strlen(report));
+    free(report);
+    return 0;
+}
+
+
+/*
+ * Every command the server accepts. To add one, write its handler and
+ * register it here with its name, stats id and arity.
+ */
+static const Command commands[] = {
+    COMMAND("list_users", STAT_LIST_USERS, 1, 3, cmd_list_users),
+    COMMAND("make_friends", STAT_MAKE_FRIENDS, 2, 2, cmd_make_friends),
+    COMMAND("post", STAT_POST, 3, 0, cmd_post),
+    COMMAND("broadcast", STAT_BROADCAST, 2, 0, cmd_broadcast),
+    COMMAND("profile", STAT_PROFILE, 2, 4, cmd_profile),
+    COMMAND("suggest", STAT_SUGGEST, 1, 2, cmd_suggest),
+    COMMAND("feed", STAT_FEED, 1, 2, cmd_feed),
+    COMMAND("search", STAT_SEARCH, 2, 0, cmd_search),
+    COMMAND("stats", STAT_STATS, 1, 1, cmd_stats),
+    COMMAND("quit", STAT_QUIT, 1, 1, cmd_quit),
+};
+
+#define NUM_COMMANDS (int)(sizeof(commands) / sizeof(commands[0]))
+#define COMMAND_SLOTS 64        // power of two, well above NUM_COMMANDS
+
+/*
+ * Open-addressing index from a command name's hash to its table entry,
+ * built once by init_commands before any worker starts and only read after
+ * that. With the current names no two share a slot, so a lookup costs one
+ * hash of the first token and one comparison.
+ */
+static const Command *command_index[COMMAND_SLOTS];
+static int command_name_max = 0;    // longest command name
+
+
+/*
+ * Build the command index. Must be called before the first process_args.
+ */
+void init_commands(void) {
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+        const Command *command = &commands[i];
+        unsigned int slot = hash_name(command->name) & (COMMAND_SLOTS - 1);
+        while (command_index[slot] != NULL) {
+            slot = (slot + 1) & (COMMAND_SLOTS - 1);
+        }
+        command_index[slot] = command;
+        if (command->name_len > command_name_max) {
+            command_name_max = command->name_len;
+        }
+    }
+}
+
+
+/*
+ * Return the command named by token, or NULL if there is none.
+ */
+static const Command *find_command(const Token *token) {
+    if (token->len > command_name_max) {
+        return NULL;
+    }
+    unsigned int slot = hash_name(token->text) & (COMMAND_SLOTS - 1);
+    const Command *command;
+    while ((command = command_index[slot]) != NULL) {
+        if (command->name_len == token->len
+                && memcmp(command->name, token->text, token->len) == 0) {
+            return command;
+        }
+        slot = (slot + 1) & (COMMAND_SLOTS - 1);
+    }
+    return NULL;
+}
+
+
+/* 
+ * Read and process commands
+ * Return:  -1 for quit command
+ *          0 otherwise
+ */
+int process_args(int cmd_argc, Token *cmd_argv, User **user_list_ptr,
+        Client *client) {
+    if (cmd_argc <= 0) {
+        return 0;
+    }
+    User *user_list = __atomic_load_n(user_list_ptr, __ATOMIC_ACQUIRE);
+    long start = stats_now();
+    int result = 0;
+
+    const Command *command = find_command(&cmd_argv[0]);
+    if (command != NULL && cmd_argc >= command->min_args
+            && (command->max_args == 0 || cmd_argc <= command->max_args)) {
+        result = command->handler(cmd_argc, cmd_argv, user_list, client);
+        stats_command(command->id, start);
+    } else {
+        error("Incorrect syntax", client);
+        stats_command(STAT_INVALID, start);
+    }
+    return result;
+}
@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "friends.h"
+#include "search.h"
+
+#define SEARCH_BLOCK 128        // ids per posting list block
+#define SHARD_BITS 4
+#define SHARDS (1 << SHARD_BITS)    // independently locked parts of the index
+#define TERMS_MIN_CAP 64        // initial number of slots in a term table
+#define CHUNK_BITS 16
+#define CHUNK_SIZE (1 << CHUNK_BITS)    // entries per chunk of the post table
+#define MAX_CHUNKS (1 << 16)            // chunks the post table can hold
+#define QUERY_TERMS_MAX 16      // terms of a query past this are ignored
+#define VARINT_MAX 10           // most bytes a varint of an unsigned long takes
+
+/*
+ * Where one block of a posting list starts. The first id is kept here in
+ * full; the others follow in the list's bytes as varint deltas.
+ */
+typedef struct block {
+    unsigned long first;
+    int offset;             // offset in bytes of the second id's delta
+} Block;
+
+/*
+ * A term and its posting list, oldest post first. Ids are kept sorted even
+ * when a post is indexed after a newer one.
+ */
+typedef struct term {
+    char word[SEARCH_TERM_MAX + 1];
+    unsigned char *bytes;   // varint deltas, block after block
+    int bytes_len;
+    int bytes_cap;
+    Block *blocks;
+    int num_blocks;
+    int blocks_cap;
+    long count;             // ids in the list
+    unsigned long last;     // newest id in the list
+} Term;
+
+/*
+ * Position of a lookup in one posting list: the block decoded last, so that
+ * a run of nearby ids only decodes it once.
+ */
+typedef struct cursor {
+    const Term *term;
+    int block;              // decoded block, or -1 for none yet
+    int len;                // ids in the decoded block
+    unsigned long ids[SEARCH_BLOCK];
+} Cursor;
+
+/*
+ * One part of the index: the terms whose hash has its number in the top
+ * SHARD_BITS bits, each part under its own lock, so that posts with
+ * different terms are indexed in parallel.
+ */
+typedef struct shard {
+    pthread_rwlock_t lock;  // guards the rest; writer-preferring so posting
+                            // is not starved
+    Pool term_pool;
+
+    // open-addressing (linear probing) table of terms, keyed on the word
+    Term **terms;
+    unsigned int terms_cap;     // always a power of two
+    unsigned int terms_count;
+
+    size_t postings_bytes;      // held by posting lists and block tables
+} Shard;
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static Shard shards[SHARDS];
+
+// the post with id i is chunks[i >> CHUNK_BITS][i & (CHUNK_SIZE - 1)]; a
+// chunk is allocated by the first post that needs it, and never moves
+static FeedItem *chunks[MAX_CHUNKS];
+static long num_chunks = 0;
+
+
+/*
+ * Set up the term pools and the shard locks.
+ */
+static void init_search(void) {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+        PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, &attr);
+        pool_init(&shards[i].term_pool, sizeof(Term));
+    }
+    pthread_rwlockattr_destroy(&attr);
+}
+
+
+/*
+ * Return the shard that holds the terms with this hash.
+ */
+static Shard *shard_of(unsigned int hash) {
+    return &shards[hash >> (32 - SHARD_BITS)];
+}
+
+
+/*
+ * Copy the next term of the len bytes of text, from *pos on, into word,
+ * lowercased and NUL-terminated, and advance *pos past it.
+ * Return the length of the term, or 0 if there are no more.
+ */
+static int next_term(const char *text, int len, int *pos, char *word) {
+    int i = *pos;
+    while (i < len && !isalnum((unsigned char)text[i])) {
+        i++;
+    }
+    int n = 0;
+    while (i < len && isalnum((unsigned char)text[i])) {
+        if (n < SEARCH_TERM_MAX) {
+            word[n++] = tolower((unsigned char)text[i]);
+        }
+        i++;
+    }
+    word[n] = '\0';
+    *pos = i;
+    return n;
+}
+
+
+/*
+ * Return the slot of shard's term table holding word, whose hash is hash,
+ * or the empty slot where it would go. The caller must hold shard->lock and
+ * shard->terms_cap must be > 0.
+ */
+static Term **term_slot(Shard *shard, const char *word, unsigned int hash) {
+    unsigned int mask = shard->terms_cap - 1;
+    unsigned int i = hash & mask;
+    while (shard->terms[i] != NULL
+            && strcmp(shard->terms[i]->word, word) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &shard->terms[i];
+}
+
+
+/*
+ * Grow shard's term table to new_cap slots and rehash every term. The
+ * caller must hold shard->lock for writing.
+ */
+static void terms_resize(Shard *shard, unsigned int new_cap) {
+    Term **old = shard->terms;
+    unsigned int old_cap = shard->terms_cap;
+
+    shard->terms = calloc(new_cap, sizeof(Term *));
+    if (shard->terms == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    shard->terms_cap = new_cap;
+    for (unsigned int i = 0; i < old_cap; i++) {
+        if (old[i] != NULL) {
+            *term_slot(shard, old[i]->word, hash_name(old[i]->word)) = old[i];
+        }
+    }
+    free(old);
+}
+
+
+/*
+ * Return the term for word, whose hash is hash, creating it with an empty
+ * posting list if it is new. The caller must hold shard->lock for writing.
+ */
+static Term *get_term(Shard *shard, const char *word, unsigned int hash) {
+    if ((shard->terms_count + 1) * 2 > shard->terms_cap) {
+        terms_resize(shard, shard->terms_cap == 0 ? TERMS_MIN_CAP
+            : shard->terms_cap * 2);
+    }
+    Term **slot = term_slot(shard, word, hash);
+    if (*slot == NULL) {
+        Term *term = pool_alloc(&shard->term_pool);
+        memset(term, 0, sizeof(Term));
+        strcpy(term->word, word);
+        *slot = term;
+        shard->terms_count++;
+    }
+    return *slot;
+}
+
+
+/*
+ * Return the term for word, whose hash is hash, or NULL if no post contains
+ * it. The caller must hold shard->lock.
+ */
+static const Term *find_term(Shard *shard, const char *word,
+        unsigned int hash) {
+    if (shard->terms_cap == 0) {
+        return NULL;
+    }
+    return *term_slot(shard, word, hash);
+}
+
+
+/*
+ * Append the varint encoding of value to out. Return the number of bytes
+ * written.
+ */
+static int put_varint(unsigned char *out, unsigned long value) {
+    int n = 0;
+    while (value >= 0x80) {
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+
+/*
+ * Decode the varint at *in and advance *in past it.
+ */
+static unsigned long get_varint(const unsigned char **in) {
+    unsigned long value = 0;
+    int shift = 0;
+    const unsigned char *p = *in;
+    while (*p & 0x80) {
+        value |= (unsigned long)(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    value |= (unsigned long)*p++ << shift;
+    *in = p;
+    return value;
+}
+
+
+/*
+ * Add id, which is newer than every id in term's list, to the list. A term
+ * that appears several times in one post is only listed once. The caller
+ * must hold shard->lock for writing.
+ */
+static void term_append(Shard *shard, Term *term, unsigned long id) {
+    if (term->count > 0 && term->last == id) {
+        return;
+    }
+
+    if (term->count % SEARCH_BLOCK == 0) {
+        if (term->num_blocks == term->blocks_cap) {
+            int new_cap = term->blocks_cap == 0 ? 1 : term->blocks_cap * 2;
+            Block *blocks = realloc(term->blocks, new_cap * sizeof(Block));
+            if (blocks == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            shard->postings_bytes += (new_cap - term->blocks_cap)
+                * sizeof(Block);
+            term->blocks = blocks;
+            term->blocks_cap = new_cap;
+        }
+        term->blocks[term->num_blocks++] = (Block){id, term->bytes_len};
+    } else {
+        if (term->bytes_len + VARINT_MAX > term->bytes_cap) {
+            int new_cap = term->bytes_cap == 0 ? 64 : term->bytes_cap * 2;
+            unsigned char *bytes = realloc(term->bytes, new_cap);
+            if (bytes == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+            shard->postings_bytes += new_cap - term->bytes_cap;
+            term->bytes = bytes;
+            term->bytes_cap = new_cap;
+        }
+        term->bytes_len += put_varint(term->bytes + term->bytes_len,
+            id - term->last);
+    }
+    term->count++;
+    term->last = id;
+}
+
+
+/*
+ * Decode block b of term's posting list into ids. Return the number of ids
+ * in the block. The caller must hold the term's shard lock.
+ */
+static int decode_block(const Term *term, int b, unsigned long *ids) {
+    long left = term->count - (long)b * SEARCH_BLOCK;
+    int len = left < SEARCH_BLOCK ? left : SEARCH_BLOCK;
+    const unsigned char *in = term->bytes + term->blocks[b].offset;
+    ids[0] = term->blocks[b].first;
+    for (int i = 1; i < len; i++) {
+        ids[i] = ids[i - 1] + get_varint(&in);
+    }
+    return len;
+}
+
+
+/*
+ * Return the block of term's posting list that id would be in: the last
+ * one whose first id is at most id, or -1 if id is older than them all.
+ */
+static int find_block(const Term *term, unsigned long id) {
+    int lo = 0, hi = term->num_blocks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (term->blocks[mid].first <= id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+
+/*
+ * Add id to term's list. Posts are indexed after their target is unlocked,
+ * so a newer post may have got in first; then the blocks from the one id
+ * belongs in onward are decoded and appended again with id in its place.
+ * Ids arrive at most a few posts late, so that is nearly always only the
+ * last block. The caller must hold shard->lock for writing.
+ */
+static void term_add(Shard *shard, Term *term, unsigned long id) {
+    if (term->count == 0 || id > term->last) {
+        term_append(shard, term, id);
+        return;
+    }
+
+    int b = find_block(term, id);
+    if (b < 0) {
+        b = 0;
+    }
+    long tail = term->count - (long)b * SEARCH_BLOCK;
+    unsigned long *ids = malloc((tail + 1) * sizeof(unsigned long));
+    if (ids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    long len = 0;
+    for (int i = b; i < term->num_blocks; i++) {
+        len += decode_block(term, i, ids + len);
+    }
+
+    // a term repeated in one post is only listed once
+    long at = 0;
+    while (at < len && ids[at] < id) {
+        at++;
+    }
+    if (at < len && ids[at] == id) {
+        free(ids);
+        return;
+    }
+    memmove(ids + at + 1, ids + at, (len - at) * sizeof(unsigned long));
+    ids[at] = id;
+
+    term->bytes_len = term->blocks[b].offset;
+    term->num_blocks = b;
+    term->count = (long)b * SEARCH_BLOCK;
+    term->last = 0;
+    for (long i = 0; i <= len; i++) {
+        term_append(shard, term, ids[i]);
+    }
+    free(ids);
+}
+
+
+/*
+ * Return 1 if cursor's posting list contains id, 0 otherwise. Only the one
+ * block that could hold id is decoded, found by binary search on the first
+ * ids of the blocks. The caller must hold the term's shard lock.
+ */
+static int cursor_contains(Cursor *cursor, unsigned long id) {
+    const Term *term = cursor->term;
+
+    // queries test ids in order, so the last block is usually the right one
+    int b = cursor->block;
+    if (b < 0 || term->blocks[b].first > id
+            || (b + 1 < term->num_blocks && term->blocks[b + 1].first <= id)) {
+        b = find_block(term, id);
+    }
+    if (b < 0) {
+        return 0;
+    }
+    if (cursor->block != b) {
+        cursor->block = b;
+        cursor->len = decode_block(term, b, cursor->ids);
+    }
+
+    int lo = 0, hi = cursor->len;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cursor->ids[mid] < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < cursor->len && cursor->ids[lo] == id;
+}
+
+
+/*
+ * Return the slot of the post table for id, allocating its chunk if no post
+ * has needed it yet. Chunks never move, so the slot can be filled without
+ * a lock.
+ */
+static FeedItem *post_slot(unsigned long id) {
+    unsigned long c = id >> CHUNK_BITS;
+    if (c >= MAX_CHUNKS) {
+        fprintf(stderr, "search: too many posts\n");
+        exit(1);
+    }
+    FeedItem *chunk = __atomic_load_n(&chunks[c], __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        FeedItem *fresh = calloc(CHUNK_SIZE, sizeof(FeedItem));
+        if (fresh == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        if (__atomic_compare_exchange_n(&chunks[c], &chunk, fresh, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            __atomic_add_fetch(&num_chunks, 1, __ATOMIC_RELAXED);
+            chunk = fresh;
+        } else {
+            free(fresh);    // another thread allocated it first
+        }
+    }
+    return &chunk[id & (CHUNK_SIZE - 1)];
+}
+
+
+/*
+ * Index the count posts in items, which all share the same contents, under
+ * every term of the contents. The id of each post is its seq. The contents
+ * are split into terms once, and each term takes only the lock of its own
+ * shard, so posts with different terms are indexed in parallel. Call with
+ * no user locked. Safe to call from any thread.
+ */
+void search_add(const FeedItem *items, int count) {
+    pthread_once(&init_once, init_search);
+
+    // a post is in the table before any list names it; the shard locks
+    // publish it to searches that find it there
+    for (int i = 0; i < count; i++) {
+        *post_slot(items[i].post->seq) = items[i];
+    }
+
+    const Str *contents = items[0].post->contents;
+    char word[SEARCH_TERM_MAX + 1];
+    int pos = 0;
+    while (next_term(contents->text, contents->len, &pos, word) > 0) {
+        unsigned int hash = hash_name(word);
+        Shard *shard = shard_of(hash);
+        pthread_rwlock_wrlock(&shard->lock);
+        Term *term = get_term(shard, word, hash);
+        for (int i = 0; i < count; i++) {
+            term_add(shard, term, items[i].post->seq);
+        }
+        pthread_rwlock_unlock(&shard->lock);
+    }
+}
+
+
+/*
+ * Unlock the shards marked in locked, which a query read-locked.
+ */
+static void unlock_shards(const int *locked) {
+    for (int i = SHARDS - 1; i >= 0; i--) {
+        if (locked[i]) {
+            pthread_rwlock_unlock(&shards[i].lock);
+        }
+    }
+}
+
+
+/*
+ * Find the posts whose contents contain every term of the num_words
+ * NUL-terminated words, and store up to limit of them, newest first, in
+ * out. limit is capped at SEARCH_MAX.
+ *
+ * The rarest term's list is decoded a block at a time from the newest end,
+ * and each of its ids is looked up in the other lists in turn, so the work
+ * is bounded by the rarest list, and stops as soon as limit posts match.
+ * The shards of the query's terms are read-locked in order, so a query
+ * sees each list whole.
+ *
+ * Return the number of posts stored, or -1 if the words hold no terms.
+ */
+int search_posts(const char *const *words, int num_words, int limit,
+        FeedItem *out) {
+    if (limit > SEARCH_MAX) {
+        limit = SEARCH_MAX;
+    }
+
+    char query[QUERY_TERMS_MAX][SEARCH_TERM_MAX + 1];
+    int num_terms = 0;
+    for (int i = 0; i < num_words && num_terms < QUERY_TERMS_MAX; i++) {
+        int len = strlen(words[i]);
+        int pos = 0;
+        while (num_terms < QUERY_TERMS_MAX
+                && next_term(words[i], len, &pos, query[num_terms]) > 0) {
+            num_terms++;
+        }
+    }
+    if (num_terms == 0) {
+        return -1;
+    }
+
+    pthread_once(&init_once, init_search);
+    unsigned int hashes[QUERY_TERMS_MAX];
+    int locked[SHARDS] = {0};
+    for (int i = 0; i < num_terms; i++) {
+        hashes[i] = hash_name(query[i]);
+        locked[shard_of(hashes[i]) - shards] = 1;
+    }
+    for (int i = 0; i < SHARDS; i++) {
+        if (locked[i]) {
+            pthread_rwlock_rdlock(&shards[i].lock);
+        }
+    }
+
+    // any unknown term means no post has them all
+    const Term *found[QUERY_TERMS_MAX];
+    for (int i = 0; i < num_terms; i++) {
+        found[i] = find_term(shard_of(hashes[i]), query[i], hashes[i]);
+        if (found[i] == NULL) {
+            unlock_shards(locked);
+            return 0;
+        }
+    }
+
+    // rarest term first
+    for (int i = 1; i < num_terms; i++) {
+        const Term *term = found[i];
+        int j = i;
+        for (; j > 0 && found[j - 1]->count > term->count; j--) {
+            found[j] = found[j - 1];
+        }
+        found[j] = term;
+    }
+    Cursor cursors[QUERY_TERMS_MAX];
+    for (int i = 1; i < num_terms; i++) {
+        cursors[i].term = found[i];
+        cursors[i].block = -1;
+    }
+
+    int count = 0;
+    unsigned long ids[SEARCH_BLOCK];
+    for (int b = found[0]->num_blocks - 1; b >= 0 && count < limit; b--) {
+        int len = decode_block(found[0], b, ids);
+        for (int i = len - 1; i >= 0 && count < limit; i--) {
+            int match = 1;
+            for (int t = 1; t < num_terms && match; t++) {
+                match = cursor_contains(&cursors[t], ids[i]);
+            }
+            if (match) {
+                out[count++] = chunks[ids[i] >> CHUNK_BITS]
+                    [ids[i] & (CHUNK_SIZE - 1)];
+            }
+        }
+    }
+
+    unlock_shards(locked);
+    return count;
+}
+
+
+/*
+ * Add the memory held by the index to stats.
+ */
+void search_memory(MemStats *stats) {
+    pthread_once(&init_once, init_search);
+    size_t tables = __atomic_load_n(&num_chunks, __ATOMIC_RELAXED)
+        * CHUNK_SIZE * sizeof(FeedItem);
+    for (int i = 0; i < SHARDS; i++) {
+        Shard *shard = &shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        pool_stats(&shard->term_pool, stats);
+        tables += shard->terms_cap * sizeof(Term *) + shard->postings_bytes;
+        pthread_rwlock_unlock(&shard->lock);
+    }
+    stats->reserved += tables;
+    stats->used += tables;
+}
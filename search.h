@@ -0,0 +1,41 @@
+/*
+ * Full-text search over post contents. Every post is indexed as it is
+ * added, under each distinct term of its contents: a term is a run of
+ * letters and digits, lowercased and cut to SEARCH_TERM_MAX characters.
+ *
+ * Each term maps to a posting list of the ids of the posts containing it.
+ * A post's id is its seq. A list is kept sorted and stored as varint
+ * deltas, in blocks of SEARCH_BLOCK ids with the first id and offset of
+ * every block kept apart; a lookup binary-searches the block table and
+ * decodes one block, which is what lets a multi-term query test the
+ * candidates from its rarest term against the longer lists without
+ * decoding them.
+ *
+ * Terms are spread over shards by hash, each with its own lock, and posts
+ * are indexed after their target is unlocked, so indexing neither holds a
+ * user lock nor serializes posting across workers.
+ */
+
+#define SEARCH_MAX 100          // Max posts returned by one search
+#define SEARCH_TERM_MAX 32      // Max length of an indexed term
+
+/*
+ * Index the count posts in items, which all share the same contents, under
+ * every term of the contents. The id of each post is its seq. Call with no
+ * user locked. Safe to call from any thread.
+ */
+void search_add(const FeedItem *items, int count);
+
+/*
+ * Find the posts whose contents contain every term of the num_words
+ * NUL-terminated words, and store up to limit of them, newest first, in
+ * out. limit is capped at SEARCH_MAX.
+ * Return the number of posts stored, or -1 if the words hold no terms.
+ */
+int search_posts(const char *const *words, int num_words, int limit,
+        FeedItem *out);
+
+/*
+ * Add the memory held by the index to stats.
+ */
+void search_memory(MemStats *stats);
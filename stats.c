@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "friends.h"
+#include "stats.h"
+#include "log.h"
+
+#define SUB_BITS 2                      // 4 buckets per power of two
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS (64 * SUB_BUCKETS)
+#define REPORT_LINE 128                 // room for one line of the report
+
+static const char *command_names[NUM_STAT_COMMANDS] = {
+    "list_users", "make_friends", "post", "broadcast", "profile", "suggest",
+    "feed", "search", "stats", "quit", "invalid"
+};
+
+static const char *event_names[NUM_STAT_EVENTS] = {
+    "conns_rejected", "rate_limited", "reaped", "accept_errors"
+};
+
+/*
+ * Log-linear latency histogram in nanoseconds: each power of two is split
+ * into SUB_BUCKETS equal buckets, so every bucket is within 25% of the
+ * values it holds, at a fixed 2 KiB per command.
+ */
+typedef struct histogram {
+    long total_ns;
+    long max_ns;
+    long buckets[HIST_BUCKETS];
+} Histogram;
+
+static Histogram commands[NUM_STAT_COMMANDS];
+static long bytes_in = 0;
+static long bytes_out = 0;
+static long events[NUM_STAT_EVENTS];
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+long stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*
+ * Return the histogram bucket that holds ns.
+ */
+static int bucket_of(long ns) {
+    if (ns < SUB_BUCKETS) {
+        return ns < 0 ? 0 : ns;
+    }
+    int exp = 63 - __builtin_clzl(ns);
+    int sub = (ns >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1);
+    return exp * SUB_BUCKETS + sub;
+}
+
+
+/*
+ * Return the largest value that falls in bucket.
+ */
+static long bucket_max(int bucket) {
+    if (bucket < 2 * SUB_BUCKETS) {
+        return bucket;
+    }
+    int exp = bucket / SUB_BUCKETS;
+    long sub = bucket % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << (exp - SUB_BITS)) - 1;
+}
+
+
+/*
+ * Record one run of command that started at start, from stats_now.
+ */
+void stats_command(int command, long start) {
+    long ns = stats_now() - start;
+    Histogram *hist = &commands[command];
+    __atomic_add_fetch(&hist->total_ns, ns, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hist->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+
+    long max = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&hist->max_ns, &max, ns,
+            1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*
+ * Count len bytes read from clients.
+ */
+void stats_bytes_in(long len) {
+    __atomic_add_fetch(&bytes_in, len, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Count len bytes written to clients.
+ */
+void stats_bytes_out(long len) {
+    __atomic_add_fetch(&bytes_out, len, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Count one occurrence of event.
+ */
+void stats_event(int event) {
+    __atomic_add_fetch(&events[event], 1, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Return the upper bound, in microseconds, of the bucket holding the p-th
+ * percentile of the count values in buckets, but no more than max_ns.
+ */
+static double percentile_us(const long *buckets, long count, double p,
+        long max_ns) {
+    long rank = (long)(p / 100.0 * count + 0.5);
+    long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen >= rank && seen > 0) {
+            long ns = bucket_max(i);
+            return (ns < max_ns ? ns : max_ns) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * Return a dynamically allocated report of every counter and histogram,
+ * plus the gauges: connected clients, users, posts, allocator memory and
+ * dropped log lines.
+ * Lines end in network newlines.
+ */
+char *stats_report(int clients) {
+    long users, posts;
+    MemStats mem = {0, 0, 0};
+    object_counts(&users, &posts);
+    memory_usage(&mem);
+
+    int buf_len = REPORT_LINE * (9 + NUM_STAT_EVENTS + NUM_STAT_COMMANDS);
+    char *buf = malloc(buf_len);
+    if (buf == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    int len = snprintf(buf, buf_len,
+        "clients %d\r\nusers %ld\r\nposts %ld\r\n"
+        "bytes_in %ld\r\nbytes_out %ld\r\n"
+        "mem_reserved %zu\r\nmem_used %zu\r\nlog_dropped %ld\r\n",
+        clients, users, posts,
+        __atomic_load_n(&bytes_in, __ATOMIC_RELAXED),
+        __atomic_load_n(&bytes_out, __ATOMIC_RELAXED),
+        mem.reserved, mem.used, log_dropped());
+    for (int e = 0; e < NUM_STAT_EVENTS; e++) {
+        len += snprintf(buf + len, buf_len - len, "%s %ld\r\n",
+            event_names[e], __atomic_load_n(&events[e], __ATOMIC_RELAXED));
+    }
+    len += snprintf(buf + len, buf_len - len,
+        "%-13s %10s %10s %10s %10s %10s %10s\r\n",
+        "command", "count", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+
+    for (int c = 0; c < NUM_STAT_COMMANDS; c++) {
+        // copy the buckets first so the percentiles agree with one count
+        long buckets[HIST_BUCKETS];
+        long count = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            buckets[i] = __atomic_load_n(&commands[c].buckets[i],
+                __ATOMIC_RELAXED);
+            count += buckets[i];
+        }
+        if (count == 0) {
+            continue;
+        }
+        long total = __atomic_load_n(&commands[c].total_ns, __ATOMIC_RELAXED);
+        long max = __atomic_load_n(&commands[c].max_ns, __ATOMIC_RELAXED);
+        len += snprintf(buf + len, buf_len - len,
+            "%-13s %10ld %10.1f %10.1f %10.1f %10.1f %10.1f\r\n",
+            command_names[c], count, total / 1000.0 / count,
+            percentile_us(buckets, count, 50, max),
+            percentile_us(buckets, count, 99, max),
+            percentile_us(buckets, count, 99.9, max), max / 1000.0);
+    }
+    return buf;
+}
@@ -0,0 +1,62 @@
+/*
+ * Server metrics: counters and per-command latency histograms.
+ *
+ * Every update is a single relaxed atomic add, so workers record without
+ * taking locks or waiting on each other. A report reads each value exactly
+ * but the set of them only approximately at one instant, which is all a
+ * monitoring view needs.
+ */
+
+// commands whose latency is recorded separately
+enum {
+    STAT_LIST_USERS,
+    STAT_MAKE_FRIENDS,
+    STAT_POST,
+    STAT_BROADCAST,
+    STAT_PROFILE,
+    STAT_SUGGEST,
+    STAT_FEED,
+    STAT_SEARCH,
+    STAT_STATS,
+    STAT_QUIT,
+    STAT_INVALID,       // anything that got "Incorrect syntax"
+    NUM_STAT_COMMANDS
+};
+
+// connection events that are counted
+enum {
+    STAT_CONNS_REJECTED,    // turned away because the server was full
+    STAT_RATE_LIMITED,      // commands refused by the rate limiter
+    STAT_REAPED,            // clients dropped for idling or not logging in
+    STAT_ACCEPT_ERRORS,     // accept failures other than a drained backlog
+    NUM_STAT_EVENTS
+};
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+long stats_now(void);
+
+/*
+ * Record one run of command that started at start, from stats_now.
+ */
+void stats_command(int command, long start);
+
+/*
+ * Count len bytes read from or written to clients.
+ */
+void stats_bytes_in(long len);
+void stats_bytes_out(long len);
+
+/*
+ * Count one occurrence of event.
+ */
+void stats_event(int event);
+
+/*
+ * Return a dynamically allocated report of every counter and histogram,
+ * plus the gauges: connected clients, users, posts, allocator memory and
+ * dropped log lines.
+ * Lines end in network newlines.
+ */
+char *stats_report(int clients);
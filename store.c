@@ -0,0 +1,741 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "friends.h"
+#include "store.h"
+#include "log.h"
+
+#define COMMIT_INTERVAL_MS 10               // longest a mutation waits for fsync
+#ifndef SNAPSHOT_LOG_BYTES
+  #define SNAPSHOT_LOG_BYTES (64 << 20)     // log size that triggers a snapshot
+#endif
+#define SNAPSHOT_BUF_SIZE (1 << 20)         // write buffer of the snapshot child
+#define SNAPSHOT_MAGIC "FMSNAP01"
+#define SNAPSHOT_END "FMSNPEND"
+#define MAGIC_LEN 8
+#define RECORD_HEADER 8                     // u32 length, u32 checksum
+
+// log record types
+#define REC_USER 1          // name
+#define REC_FRIENDS 2       // name1, name2
+#define REC_POST 3          // author, target, date, contents
+
+/*
+ * Growable byte buffer used to build log records.
+ */
+typedef struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+/*
+ * Bounds-checked reader over a mapped file.
+ */
+typedef struct reader {
+    const char *pos;
+    const char *end;
+    int failed;             // set once a read runs past end
+} Reader;
+
+static char *data_dir;
+static User **users;                // head of the list being persisted
+
+// records made since the last commit; guarded by pending_lock
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static Buf pending;
+
+// only touched by the committer thread once store_open returns
+static int log_fd = -1;
+static unsigned int log_gen;        // generation of the log being appended to
+static size_t log_bytes;            // log bytes written since the snapshot
+static pid_t snapshot_pid = -1;     // child writing a snapshot, if any
+static unsigned int snapshot_gen;   // first log generation it does not cover
+
+// the snapshot child writes through this buffer; allocated before fork
+static char *snap_buf;
+static size_t snap_len;
+static int snap_fd;
+static long open_max;               // descriptor limit, read before fork
+
+
+/*
+ * Exit with a message naming path if a system call failed.
+ */
+static void check(int result, const char *what, const char *path) {
+    if (result == -1) {
+        fprintf(stderr, "store: %s %s: %s\n", what, path, strerror(errno));
+        exit(1);
+    }
+}
+
+
+/*
+ * Return the FNV-1a hash of len bytes of data, used to detect torn records.
+ */
+static uint32_t checksum(const char *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+/*
+ * Append len bytes of data to buf, growing it as needed.
+ */
+static void buf_put(Buf *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        size_t cap = buf->cap == 0 ? 4096 : buf->cap;
+        while (cap < buf->len + len) {
+            cap *= 2;
+        }
+        char *new_data = realloc(buf->data, cap);
+        if (new_data == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+        buf->data = new_data;
+        buf->cap = cap;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+
+/*
+ * Append a name to buf as a one byte length followed by its characters.
+ */
+static void buf_put_name(Buf *buf, const char *name) {
+    uint8_t len = strlen(name);
+    buf_put(buf, &len, 1);
+    buf_put(buf, name, len);
+}
+
+
+/*
+ * Copy len bytes from the reader into dest, or mark it failed.
+ */
+static void read_bytes(Reader *r, void *dest, size_t len) {
+    if (r->failed || (size_t)(r->end - r->pos) < len) {
+        r->failed = 1;
+        memset(dest, 0, len);
+        return;
+    }
+    memcpy(dest, r->pos, len);
+    r->pos += len;
+}
+
+
+static uint32_t read_u32(Reader *r) {
+    uint32_t value;
+    read_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+
+static int64_t read_i64(Reader *r) {
+    int64_t value;
+    read_bytes(r, &value, sizeof(value));
+    return value;
+}
+
+
+/*
+ * Read a name written by buf_put_name into name, which holds MAX_NAME bytes.
+ */
+static void read_name(Reader *r, char *name) {
+    uint8_t len;
+    read_bytes(r, &len, 1);
+    if (len >= MAX_NAME) {
+        r->failed = 1;
+        len = 0;
+    }
+    read_bytes(r, name, len);
+    name[len] = '\0';
+}
+
+
+/*
+ * Return a pointer to len bytes of the reader's data, without copying.
+ */
+static const char *read_span(Reader *r, size_t len) {
+    if (r->failed || (size_t)(r->end - r->pos) < len) {
+        r->failed = 1;
+        return NULL;
+    }
+    const char *span = r->pos;
+    r->pos += len;
+    return span;
+}
+
+
+/*
+ * Return the malloc'd path of file name in the data directory.
+ */
+static char *store_path(const char *name) {
+    size_t len = strlen(data_dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    snprintf(path, len, "%s/%s", data_dir, name);
+    return path;
+}
+
+
+/*
+ * Return the malloc'd path of the log file of generation gen.
+ */
+static char *log_path(unsigned int gen) {
+    char name[32];
+    snprintf(name, sizeof(name), "log.%u", gen);
+    return store_path(name);
+}
+
+
+/*
+ * Map the file at path read-only. Return its length in *len, or NULL if
+ * it does not exist or is empty.
+ */
+static const char *map_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        if (errno == ENOENT) {
+            return NULL;
+        }
+        check(-1, "open", path);
+    }
+    struct stat st;
+    check(fstat(fd, &st), "stat", path);
+    *len = st.st_size;
+    if (*len == 0) {
+        close(fd);
+        return NULL;
+    }
+    const char *data = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        check(-1, "mmap", path);
+    }
+    close(fd);
+    madvise((void *)data, *len, MADV_SEQUENTIAL);
+    return data;
+}
+
+
+/*
+ * Rebuild the user list from the snapshot. Return the generation of the
+ * first log that it does not cover, or 0 if there is no snapshot.
+ */
+static unsigned int load_snapshot(void) {
+    char *path = store_path("snapshot");
+    size_t len;
+    const char *data = map_file(path, &len);
+    if (data == NULL) {
+        free(path);
+        return 0;
+    }
+
+    Reader r = {data, data + len, 0};
+    char magic[MAGIC_LEN];
+    read_bytes(&r, magic, MAGIC_LEN);
+    unsigned int gen = read_u32(&r);
+    uint32_t count = read_u32(&r);
+    if (r.failed || memcmp(magic, SNAPSHOT_MAGIC, MAGIC_LEN) != 0
+            || memcmp(data + len - MAGIC_LEN, SNAPSHOT_END, MAGIC_LEN) != 0) {
+        fprintf(stderr, "store: %s is not a complete snapshot\n", path);
+        exit(1);
+    }
+    r.end -= MAGIC_LEN;
+
+    // every user first, so friends and authors can be resolved by name
+    User **by_pos = malloc((count > 0 ? count : 1) * sizeof(User *));
+    if (by_pos == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (uint32_t i = 0; i < count && !r.failed; i++) {
+        char name[MAX_NAME];
+        read_name(&r, name);
+        create_user(name, users);
+        by_pos[i] = find_user(name, *users);
+    }
+
+    // then each user's friends, oldest first, and posts, oldest first
+    for (uint32_t i = 0; i < count && !r.failed; i++) {
+        uint32_t num_friends = read_u32(&r);
+        for (uint32_t j = 0; j < num_friends && !r.failed; j++) {
+            char name[MAX_NAME];
+            read_name(&r, name);
+            User *friend = find_user(name, *users);
+            if (friend != NULL) {
+                restore_friend(by_pos[i], friend);
+            }
+        }
+        refresh_profile(by_pos[i]);
+
+        uint32_t posts = read_u32(&r);
+        for (uint32_t j = 0; j < posts && !r.failed; j++) {
+            char author[MAX_NAME];
+            read_name(&r, author);
+            time_t date = read_i64(&r);
+            uint32_t text_len = read_u32(&r);
+            const char *text = read_span(&r, text_len + 1);   // with its NUL
+            if (text != NULL) {
+                restore_post(author, by_pos[i], text, text_len, date);
+            }
+        }
+    }
+    if (r.failed) {
+        fprintf(stderr, "store: %s is corrupt\n", path);
+        exit(1);
+    }
+
+    free(by_pos);
+    munmap((void *)data, len);
+    free(path);
+    return gen;
+}
+
+
+/*
+ * Apply every complete record of the log of generation gen to the user
+ * list. A torn record at the end, left by a crash, ends the replay.
+ * Return the number of bytes in the log, or -1 if it does not exist.
+ */
+static long replay_log(unsigned int gen, int *num_records) {
+    char *path = log_path(gen);
+    if (access(path, F_OK) == -1) {
+        free(path);
+        return -1;
+    }
+    size_t len = 0;
+    const char *data = map_file(path, &len);
+    if (data == NULL) {
+        free(path);
+        return 0;
+    }
+
+    Reader r = {data, data + len, 0};
+    while (r.pos < r.end) {
+        uint32_t rec_len = read_u32(&r);
+        uint32_t sum = read_u32(&r);
+        const char *rec = read_span(&r, rec_len);
+        if (r.failed || rec_len == 0 || checksum(rec, rec_len) != sum) {
+            fprintf(stderr, "store: ignoring torn record at end of %s\n", path);
+            break;
+        }
+
+        Reader body = {rec + 1, rec + rec_len, 0};
+        char name1[MAX_NAME], name2[MAX_NAME];
+        switch (rec[0]) {
+            case REC_USER:
+                read_name(&body, name1);
+                create_user(name1, users);
+                break;
+            case REC_FRIENDS:
+                read_name(&body, name1);
+                read_name(&body, name2);
+                make_friends(name1, name2, *users);
+                break;
+            case REC_POST:
+            {
+                read_name(&body, name1);
+                read_name(&body, name2);
+                time_t date = read_i64(&body);
+                uint32_t text_len = read_u32(&body);
+                const char *text = read_span(&body, text_len + 1);
+                User *target = find_user(name2, *users);
+                if (text != NULL && target != NULL) {
+                    restore_post(name1, target, text, text_len, date);
+                }
+            }
+                break;
+        }
+        (*num_records)++;
+    }
+
+    munmap((void *)data, len);
+    free(path);
+    return len;
+}
+
+
+/*
+ * Start a log record of the given type in rec, leaving room for its header.
+ */
+static void begin_record(Buf *rec, uint8_t type) {
+    char header[RECORD_HEADER] = {0};
+    rec->data = NULL;
+    rec->len = rec->cap = 0;
+    buf_put(rec, header, RECORD_HEADER);
+    buf_put(rec, &type, 1);
+}
+
+
+/*
+ * Fill in the header of rec and append it to the pending log buffer. The
+ * checksum covers the type byte and the body.
+ */
+static void finish_record(Buf *rec) {
+    uint32_t len = rec->len - RECORD_HEADER;
+    uint32_t sum = checksum(rec->data + RECORD_HEADER, len);
+    memcpy(rec->data, &len, sizeof(len));
+    memcpy(rec->data + sizeof(len), &sum, sizeof(sum));
+
+    pthread_mutex_lock(&pending_lock);
+    buf_put(&pending, rec->data, rec->len);
+    pthread_mutex_unlock(&pending_lock);
+    free(rec->data);
+}
+
+
+static void log_user_created(const User *user) {
+    Buf rec;
+    begin_record(&rec, REC_USER);
+    buf_put_name(&rec, user->name);
+    finish_record(&rec);
+}
+
+
+static void log_friends_made(const User *user1, const User *user2) {
+    Buf rec;
+    begin_record(&rec, REC_FRIENDS);
+    buf_put_name(&rec, user1->name);
+    buf_put_name(&rec, user2->name);
+    finish_record(&rec);
+}
+
+
+static void log_post_made(const User *author, const User *target,
+        const Post *post) {
+    Buf rec;
+    int64_t date = post->date;
+    uint32_t text_len = post->contents->len;
+    begin_record(&rec, REC_POST);
+    buf_put_name(&rec, author->name);
+    buf_put_name(&rec, target->name);
+    buf_put(&rec, &date, sizeof(date));
+    buf_put(&rec, &text_len, sizeof(text_len));
+    buf_put(&rec, post->contents->text, text_len + 1);
+    finish_record(&rec);
+}
+
+
+/*
+ * Write all len bytes of data to fd. Return 0 on success, -1 on error.
+ */
+static int write_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/*
+ * Write and fsync every pending record: one fsync covers every mutation
+ * made since the last commit.
+ */
+static void commit(void) {
+    static Buf batch;
+
+    // swap the buffers so hooks never wait on disk I/O
+    pthread_mutex_lock(&pending_lock);
+    Buf full = pending;
+    pending = batch;
+    pending.len = 0;
+    pthread_mutex_unlock(&pending_lock);
+
+    if (full.len > 0) {
+        if (write_all(log_fd, full.data, full.len) == -1
+                || fdatasync(log_fd) == -1) {
+            perror("store: log write");
+            exit(1);
+        }
+        log_bytes += full.len;
+    }
+    batch = full;
+}
+
+
+/*
+ * Start appending to a new log of generation gen. The data directory is
+ * fsynced too, so that the file the records are committed to cannot
+ * vanish from it in a crash.
+ */
+static void open_log(unsigned int gen) {
+    char *path = log_path(gen);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    check(fd, "open", path);
+    int dir_fd = open(data_dir, O_RDONLY | O_DIRECTORY);
+    check(dir_fd, "open", data_dir);
+    check(fsync(dir_fd), "fsync", data_dir);
+    close(dir_fd);
+    if (log_fd != -1) {
+        close(log_fd);
+    }
+    log_fd = fd;
+    log_gen = gen;
+    free(path);
+}
+
+
+/*
+ * Snapshot child: copy len bytes to the snapshot file through snap_buf.
+ */
+static void snap_put(const void *data, size_t len) {
+    if (snap_len + len > SNAPSHOT_BUF_SIZE) {
+        if (write_all(snap_fd, snap_buf, snap_len) == -1) {
+            _exit(1);
+        }
+        snap_len = 0;
+    }
+    if (len > SNAPSHOT_BUF_SIZE) {
+        if (write_all(snap_fd, data, len) == -1) {
+            _exit(1);
+        }
+        return;
+    }
+    memcpy(snap_buf + snap_len, data, len);
+    snap_len += len;
+}
+
+
+static void snap_put_u32(uint32_t value) {
+    snap_put(&value, sizeof(value));
+}
+
+
+static void snap_put_name(const char *name) {
+    uint8_t len = strlen(name);
+    snap_put(&len, 1);
+    snap_put(name, len);
+}
+
+
+/*
+ * Snapshot child: close every descriptor inherited from the server except
+ * the standard ones. Otherwise a client socket the server closes while the
+ * snapshot is written would get no FIN until the child exits.
+ */
+static void close_inherited(void) {
+    if (close_range(3, ~0U, 0) == 0) {
+        return;
+    }
+    for (long fd = 3; fd < open_max; fd++) {
+        close(fd);
+    }
+}
+
+
+/*
+ * Snapshot child: write the frozen image of the user list to tmp_path,
+ * atomically rename it to path and fsync the data directory, so that the
+ * new name is durable before the parent deletes the logs it replaces. Only
+ * async-signal-safe calls are used, as the parent is multi-threaded.
+ */
+static void write_snapshot(const char *tmp_path, const char *path,
+        unsigned int gen) {
+    close_inherited();
+    snap_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (snap_fd == -1) {
+        _exit(1);
+    }
+
+    uint32_t count = 0;
+    for (const User *user = *users; user != NULL; user = user->next) {
+        count++;
+    }
+    snap_put(SNAPSHOT_MAGIC, MAGIC_LEN);
+    snap_put_u32(gen);
+    snap_put_u32(count);
+
+    for (const User *user = *users; user != NULL; user = user->next) {
+        snap_put_name(user->name);
+    }
+    for (const User *user = *users; user != NULL; user = user->next) {
+        snap_put_u32(user->num_friends);
+        for (int i = 0; i < user->num_friends; i++) {
+            snap_put_name(user->friends[i]->name);
+        }
+
+        snap_put_u32(user->num_posts);
+        for (int i = 0; i < user->num_posts; i++) {
+            const Post *post = user->posts[i];
+            int64_t date = post->date;
+            uint32_t text_len = post->contents->len;
+            snap_put_name(post->author);
+            snap_put(&date, sizeof(date));
+            snap_put_u32(text_len);
+            snap_put(post->contents->text, text_len + 1);
+        }
+    }
+    snap_put(SNAPSHOT_END, MAGIC_LEN);
+
+    if (write_all(snap_fd, snap_buf, snap_len) == -1 || fsync(snap_fd) == -1
+            || close(snap_fd) == -1 || rename(tmp_path, path) == -1) {
+        _exit(1);
+    }
+    int dir_fd = open(data_dir, O_RDONLY | O_DIRECTORY);
+    if (dir_fd == -1 || fsync(dir_fd) == -1) {
+        _exit(1);
+    }
+    close(dir_fd);
+    _exit(0);
+}
+
+
+/*
+ * Freeze the user list, roll the log over to a new generation and fork a
+ * child that writes a snapshot from its copy-on-write image. Mutations are
+ * only blocked for the duration of the fork.
+ */
+static void start_snapshot(void) {
+    char *tmp_path = store_path("snapshot.tmp");
+    char *path = store_path("snapshot");
+    if (snap_buf == NULL) {
+        snap_buf = malloc(SNAPSHOT_BUF_SIZE);
+        if (snap_buf == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+    }
+    snap_len = 0;
+    open_max = sysconf(_SC_OPEN_MAX);
+
+    freeze_users();
+    commit();                   // the old logs now hold every mutation
+    open_log(log_gen + 1);      // later mutations go to the new generation
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        write_snapshot(tmp_path, path, log_gen);
+    }
+    thaw_users();
+
+    if (pid == -1) {
+        perror("store: fork");
+    } else {
+        snapshot_pid = pid;
+        snapshot_gen = log_gen;
+        log_bytes = 0;
+    }
+    free(tmp_path);
+    free(path);
+}
+
+
+/*
+ * Once the snapshot child has finished, delete the logs it covers.
+ */
+static void reap_snapshot(void) {
+    int status;
+    if (waitpid(snapshot_pid, &status, WNOHANG) != snapshot_pid) {
+        return;
+    }
+    snapshot_pid = -1;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "store: snapshot failed; keeping the logs\n");
+        return;
+    }
+    for (unsigned int gen = snapshot_gen; gen-- > 0; ) {
+        char *path = log_path(gen);
+        int gone = unlink(path) == -1 && errno == ENOENT;
+        free(path);
+        if (gone) {
+            break;      // older generations were deleted by earlier snapshots
+        }
+    }
+}
+
+
+/*
+ * Committer thread: commit the pending records every COMMIT_INTERVAL_MS
+ * and take a snapshot whenever the log has grown large enough.
+ */
+static void *run_committer(void *arg) {
+    struct timespec interval = {0, COMMIT_INTERVAL_MS * 1000000L};
+    while (1) {
+        nanosleep(&interval, NULL);
+        commit();
+        if (snapshot_pid != -1) {
+            reap_snapshot();
+        } else if (log_bytes >= SNAPSHOT_LOG_BYTES) {
+            start_snapshot();
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Recover the state saved in dir into the empty user list *user_ptr_add by
+ * mapping the snapshot and replaying the logs after it, then start logging
+ * new mutations. Creates dir if it does not exist. Exit on I/O errors.
+ */
+void store_open(const char *dir, User **user_ptr_add) {
+    data_dir = strdup(dir);
+    users = user_ptr_add;
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        check(-1, "mkdir", dir);
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int num_users = 0, num_posts = 0, num_records = 0;
+    unsigned int gen = load_snapshot();
+    long len;
+    while ((len = replay_log(gen, &num_records)) != -1) {
+        log_bytes += len;
+        gen++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (const User *user = *users; user != NULL; user = user->next) {
+        num_users++;
+        num_posts += user->num_posts;
+    }
+    log_msg(LOG_INFO, "Recovered %d users, %d posts and %d log records in "
+        "%.3fs", num_users, num_posts, num_records,
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+    // never append after a possibly torn tail; start a fresh generation
+    open_log(gen);
+
+    FriendsHooks hooks = {log_user_created, log_friends_made, log_post_made};
+    set_friends_hooks(&hooks);
+
+    pthread_t committer;
+    int err = pthread_create(&committer, NULL, run_committer, NULL);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(err));
+        exit(1);
+    }
+    pthread_detach(committer);
+}
@@ -0,0 +1,22 @@
+/*
+ * Persistent storage for the user list: an append-only log of mutations
+ * plus periodic snapshots of the whole state.
+ *
+ * Every successful create_user, make_friends and make_post is appended to
+ * an in-memory log buffer. A committer thread writes the buffer out and
+ * fsyncs it every COMMIT_INTERVAL_MS, so many mutations share one fsync
+ * (group commit). Once the log grows past SNAPSHOT_LOG_BYTES, a snapshot
+ * is written by a forked child from a copy-on-write image of memory, and
+ * the logs it covers are deleted.
+ *
+ * Files in the data directory:
+ *      snapshot        compact binary image of every user, friend and post
+ *      log.<gen>       mutations made after the snapshot, oldest gen first
+ */
+
+/*
+ * Recover the state saved in dir into the empty user list *user_ptr_add by
+ * mapping the snapshot and replaying the logs after it, then start logging
+ * new mutations. Creates dir if it does not exist. Exit on I/O errors.
+ */
+void store_open(const char *dir, User **user_ptr_add);